@@ -0,0 +1,210 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"math"
+	"math/bits"
+
+	"github.com/kelindar/bitmap"
+)
+
+const (
+	FREE_CHUNK_BITS = 12 // Positions per free count summary (as a power of two)
+	FREE_CHUNK_SIZE = 1 << FREE_CHUNK_BITS
+
+	NO_HINT = math.MaxUint32 // No preferred position for allocation
+)
+
+// Free positions (extents below the allocation count, or table slots), with per-chunk counts to skip over
+// full areas quickly.
+type freeSet struct {
+	bits   bitmap.Bitmap
+	chunks []uint32
+	count  uint
+}
+
+func (fs *freeSet) add(pos uint32) {
+	if fs.bits.Contains(pos) {
+		return
+	}
+	fs.bits.Set(pos)
+	chunk := int(pos >> FREE_CHUNK_BITS)
+	for len(fs.chunks) <= chunk {
+		fs.chunks = append(fs.chunks, 0)
+	}
+	fs.chunks[chunk]++
+	fs.count++
+}
+
+func (fs *freeSet) remove(pos uint32) {
+	if !fs.bits.Contains(pos) {
+		return
+	}
+	fs.bits.Remove(pos)
+	fs.chunks[pos>>FREE_CHUNK_BITS]--
+	fs.count--
+}
+
+// Find the first free position in [from, to), or return false.
+func (fs *freeSet) next(from uint32, to uint32) (uint32, bool) {
+	for from < to {
+		chunk := from >> FREE_CHUNK_BITS
+		if int(chunk) >= len(fs.chunks) {
+			return 0, false
+		}
+		if fs.chunks[chunk] == 0 {
+			from = (chunk + 1) << FREE_CHUNK_BITS
+			continue
+		}
+		w := int(from >> 6)
+		if w >= len(fs.bits) {
+			return 0, false
+		}
+		if word := fs.bits[w] >> (from & 63); word != 0 {
+			pos := from + uint32(bits.TrailingZeros64(word))
+			if pos < to {
+				return pos, true
+			}
+			return 0, false
+		}
+		from = uint32(w+1) << 6
+	}
+	return 0, false
+}
+
+// Collect free extents with a scan, the first time they are needed. Extents with pending releases are left out,
+// as they are added when flushed.
+func (dc *DeviceContext) loadFreeExtents() error {
+	dc.freeOnce.Do(func() {
+		var fe freeSet
+		dc.freeErr = dc.ScanExtents(func(e *ExtentMetadata) bool {
+			return e.SnapshotId == 0
+		}, func(e *ExtentMetadata, epos uint) {
+			fe.add(uint32(epos))
+		})
+		if dc.freeErr != nil {
+			return
+		}
+		dc.metadataLock.Lock()
+		defer dc.metadataLock.Unlock()
+		dc.allocLock.Lock()
+		defer dc.allocLock.Unlock()
+		for eidx := range dc.dirtyExtents {
+			fe.remove(uint32(eidx))
+		}
+		for epos := uint(dc.superblock.AllocatedDeviceExtents); epos < uint(len(fe.bits))*64; epos++ {
+			fe.remove(uint32(epos))
+		}
+		dc.free = fe
+	})
+	return dc.freeErr
+}
+
+// Get the number of extents in the allocated area.
+func (dc *DeviceContext) allocatedExtents() uint {
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	return min(dc.totalDeviceExtents, uint(dc.superblock.AllocatedDeviceExtents))
+}
+
+// Get the number of extents available for allocation.
+func (dc *DeviceContext) FreeExtents() (uint, error) {
+	if err := dc.loadFreeExtents(); err != nil {
+		return 0, err
+	}
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	return dc.free.count + dc.totalDeviceExtents - uint(dc.superblock.AllocatedDeviceExtents), nil
+}
+
+// Allocate a new extent on the device, preferably at or after the hint for locality. Free extents are reused
+// before growing the allocated area, unless the hint is the end of it. Return the extent position.
+func (dc *DeviceContext) AllocateExtent(hint uint32) (uint32, error) {
+	if err := dc.loadFreeExtents(); err != nil {
+		return 0, err
+	}
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	allocated := dc.superblock.AllocatedDeviceExtents
+	grow := uint(allocated) < dc.totalDeviceExtents
+	if dc.free.count > 0 && (hint != allocated || !grow) {
+		epos, ok := uint32(0), false
+		if hint < allocated {
+			epos, ok = dc.free.next(hint, allocated)
+		}
+		if !ok {
+			epos, ok = dc.free.next(0, allocated)
+		}
+		if ok {
+			dc.free.remove(epos)
+			dc.metrics.allocatedExtents.Add(1)
+			return epos, nil
+		}
+	}
+	if !grow {
+		return 0, fmt.Errorf("no space left on device")
+	}
+	dc.superblock.AllocatedDeviceExtents++
+	dc.superblockDirty = true
+	dc.metrics.allocatedExtents.Add(1)
+	return allocated, nil
+}
+
+// Take the lowest free extent below the given position, if any.
+func (dc *DeviceContext) allocateBelow(limit uint32) (uint32, bool) {
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	epos, ok := dc.free.next(0, limit)
+	if ok {
+		dc.free.remove(epos)
+	}
+	return epos, ok
+}
+
+// Make extents whose release has just been written available for allocation. Must be called with the
+// metadata lock held.
+func (dc *DeviceContext) releaseExtents(eidxs []uint) {
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	for _, eidx := range eidxs {
+		if dc.dirtyExtents[eidx].SnapshotId == 0 && eidx < uint(dc.superblock.AllocatedDeviceExtents) {
+			dc.free.add(uint32(eidx))
+		}
+	}
+}
+
+// Make extents whose release was written directly to the device available for allocation.
+func (dc *DeviceContext) releaseClearedExtents(eposs []uint) {
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	for _, epos := range eposs {
+		if epos < uint(dc.superblock.AllocatedDeviceExtents) {
+			dc.free.add(uint32(epos))
+		}
+	}
+}
+
+// Shrink the allocated area of the device. Extents past the new end must be free.
+func (dc *DeviceContext) TrimAllocation(allocatedDeviceExtents uint32) {
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	for epos := allocatedDeviceExtents; epos < dc.superblock.AllocatedDeviceExtents; epos++ {
+		dc.free.remove(epos)
+	}
+	dc.superblock.AllocatedDeviceExtents = allocatedDeviceExtents
+	dc.superblockDirty = true
+}
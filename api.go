@@ -20,37 +20,74 @@
 //   - Bytes [4096, ExtentOffset) hold the volume and snapshot metadata (ExtentOffset is block aligned)
 //   - Bytes [ExtentOffset, DataOffset) hold the extent metadata (DataOffset is extent aligned)
 //   - Bytes [DataOffset, DeviceSize) hold the data
+//
+// Data is allocated in extents and tracked in blocks, with a bitmap per extent. Block and extent sizes are chosen
+// when the device is initialized (see Geometry); metadata is always accessed in units of BLOCK_SIZE.
 package dbs
 
 import (
 	"bytes"
 	"errors"
 	"fmt"
+	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/kelindar/bitmap"
 )
 
 const (
-	MAGIC   = "DBS@393!"
-	VERSION = 0x00010000
+	MAGIC            = "DBS@393!"
+	VERSION          = 0x00010000
+	VERSION_GEOMETRY = 0x00010100 // Devices with non-default geometry, so that older versions do not open them
 
 	MAX_VOLUMES          = 256
 	MAX_SNAPSHOTS        = 65535
 	MAX_VOLUME_NAME_SIZE = 255
 
-	BLOCK_SIZE           = 4096
-	EXTENT_SIZE          = 1048576 // 1 MB
+	BLOCK_SIZE           = 4096    // Default and minimum block size, unit of metadata I/O
+	EXTENT_SIZE          = 1048576 // Default extent size (1 MB)
 	EXTENT_BITMAP_SIZE   = 32
-	BLOCK_BITS_IN_EXTENT = 8
-	BLOCK_MASK_IN_EXTENT = 0xFF
+	BLOCKS_IN_EXTENT     = EXTENT_SIZE / BLOCK_SIZE
+	MAX_BLOCK_SIZE       = 65536 // 64 KB
+	MAX_BLOCKS_IN_EXTENT = EXTENT_BITMAP_SIZE * 8
 )
 
+// Sizes of the units of data tracking and allocation, fixed when the device is initialized. Blocks are the unit
+// of copy-on-write and of the block API, and must be a power of two from BLOCK_SIZE to MAX_BLOCK_SIZE. Extents
+// are the unit of allocation, and must be a power of two from one to MAX_BLOCKS_IN_EXTENT blocks, so extents of
+// 4 KB to 16 MB are possible. Larger extents mean smaller extent metadata and fewer allocations, smaller extents
+// cheaper copy-on-write. Zero sizes select the defaults.
+type Geometry struct {
+	BlockSize  uint
+	ExtentSize uint
+}
+
+// Fill in default sizes and check that the geometry is valid.
+func (g Geometry) normalize() (Geometry, error) {
+	if g.BlockSize == 0 {
+		g.BlockSize = BLOCK_SIZE
+	}
+	if g.ExtentSize == 0 {
+		g.ExtentSize = EXTENT_SIZE
+	}
+	if g.BlockSize < BLOCK_SIZE || g.BlockSize > MAX_BLOCK_SIZE || g.BlockSize&(g.BlockSize-1) != 0 {
+		return g, fmt.Errorf("block size must be a power of two from %v to %v", BLOCK_SIZE, MAX_BLOCK_SIZE)
+	}
+	if g.ExtentSize < g.BlockSize || g.ExtentSize > g.BlockSize*MAX_BLOCKS_IN_EXTENT || g.ExtentSize&(g.ExtentSize-1) != 0 {
+		return g, fmt.Errorf("extent size must be a power of two from one to %v blocks", MAX_BLOCKS_IN_EXTENT)
+	}
+	return g, nil
+}
+
 type Superblock struct {
 	Magic                  [8]byte
 	Version                uint32 // 16-bit major, 8-bit minor, 8-bit patch
 	AllocatedDeviceExtents uint32
 	DeviceSize             uint64
+	BlockSize              uint32 // Zero on devices initialized before geometry was configurable, for the default
+	ExtentSize             uint32
+	ClearedExtents         uint32 // Initialization progress, only used with MAGIC_INIT
 }
 
 type VolumeMetadata struct {
@@ -75,6 +112,98 @@ func (v *VolumeMetadata) setName(volumeName string) {
 	v.VolumeName[MAX_VOLUME_NAME_SIZE] = 0x00
 }
 
+// Device API
+
+// A handle to an open device, keeping the device context and all metadata except extents in memory. Queries are
+// served from memory and management operations only write the metadata they change. Volumes opened through the
+// handle share its device context. Changes are written through, but are only guaranteed to be durable after Sync
+// or Close. The handle is safe for concurrent use; management operations wait for in-flight volume I/O.
+//
+// Snapshots of deleted volumes are detached from the tables first and their extents are cleared afterwards,
+// possibly in the background. Snapshots left detached by an interrupted deletion are purged when the device is
+// opened.
+type Device struct {
+	dc         *DeviceContext
+	lock       sync.RWMutex
+	volumes    map[*VolumeMetadata]*VolumeContext // Open volumes
+	purgeLock  sync.Mutex                         // Serializes purges with each other and with vacuum
+	purges     sync.WaitGroup
+	purgeErr   error
+	generation uint64 // Incremented by management operations, so that exports can detect moved extents
+}
+
+func OpenDevice(device string) (*Device, error) {
+	dc, err := GetDeviceContext(device)
+	if err != nil {
+		return nil, err
+	}
+	d := &Device{
+		dc:      dc,
+		volumes: make(map[*VolumeMetadata]*VolumeContext),
+	}
+	if DefaultCacheSize > 0 {
+		dc.cache = NewBlockCache(DefaultCacheSize, dc.blockSize)
+	}
+	if orphans := dc.FindOrphanSnapshots(); len(orphans) > 0 {
+		d.purgeInBackground(orphans)
+	}
+	return d, nil
+}
+
+// Write all pending metadata updates and flush the device.
+func (d *Device) Sync() error {
+	return d.dc.Sync()
+}
+
+// Sync and close the device, after any deletions running in the background are done. All volumes opened
+// through the handle must be closed first.
+func (d *Device) Close() error {
+	err := d.WaitDeletions()
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	if len(d.volumes) > 0 {
+		return fmt.Errorf("device has open volumes")
+	}
+	if cerr := d.dc.Close(); err == nil {
+		err = cerr
+	}
+	return err
+}
+
+// Wait for deletions running in the background. Returns the first error since the last call, if any; the
+// snapshots of failed deletions are purged again when the device is next opened.
+func (d *Device) WaitDeletions() error {
+	d.purges.Wait()
+	d.purgeLock.Lock()
+	defer d.purgeLock.Unlock()
+	err := d.purgeErr
+	d.purgeErr = nil
+	return err
+}
+
+// Persist metadata after a management operation. Extent metadata goes first, so that the volume and snapshot
+// tables never refer to extents that are not recorded yet.
+func (d *Device) commit() error {
+	d.generation++
+	if err := d.dc.Flush(); err != nil {
+		return err
+	}
+	return d.dc.WriteMetadata()
+}
+
+// Run a function with a device handle that is closed afterwards.
+func withDevice(device string, fn func(d *Device) error) error {
+	d, err := OpenDevice(device)
+	if err != nil {
+		return err
+	}
+	if err := fn(d); err != nil {
+		d.Close()
+		return err
+	}
+	return d.Close()
+}
+
 // Query API
 
 type DeviceInfo struct {
@@ -83,6 +212,8 @@ type DeviceInfo struct {
 	TotalDeviceExtents     uint
 	AllocatedDeviceExtents uint
 	VolumeCount            uint
+	BlockSize              uint
+	ExtentSize             uint
 }
 
 type VolumeInfo struct {
@@ -103,27 +234,31 @@ func humanVersion(version uint32) string {
 	return fmt.Sprintf("%d.%d.%d", version>>16, (version&0xFF00)>>8, version&0xFF)
 }
 
-func GetDeviceInfo(device string) (*DeviceInfo, error) {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return nil, err
-	}
+func (d *Device) GetDeviceInfo() (*DeviceInfo, error) {
+	d.lock.RLock()
+	defer d.lock.RUnlock()
+	dc := d.dc
 	di := &DeviceInfo{
 		Version:                humanVersion(dc.superblock.Version),
 		DeviceSize:             dc.superblock.DeviceSize,
 		TotalDeviceExtents:     dc.totalDeviceExtents,
-		AllocatedDeviceExtents: uint(dc.superblock.AllocatedDeviceExtents),
+		AllocatedDeviceExtents: dc.allocatedExtents(),
 		VolumeCount:            dc.CountVolumes(),
+		BlockSize:              dc.blockSize,
+		ExtentSize:             dc.extentSize,
 	}
-	dc.Close()
 	return di, nil
 }
 
-func GetVolumeInfo(device string) ([]VolumeInfo, error) {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return nil, err
-	}
+// Get the geometry of the device. Block API requests use its block size.
+func (d *Device) Geometry() Geometry {
+	return Geometry{BlockSize: d.dc.blockSize, ExtentSize: d.dc.extentSize}
+}
+
+func (d *Device) GetVolumeInfo() ([]VolumeInfo, error) {
+	d.lock.RLock()
+	defer d.lock.RUnlock()
+	dc := d.dc
 	vi := make([]VolumeInfo, dc.CountVolumes())
 	viidx := 0
 	for i := 0; i < MAX_VOLUMES; i++ {
@@ -138,15 +273,13 @@ func GetVolumeInfo(device string) ([]VolumeInfo, error) {
 		vi[viidx].SnapshotCount = dc.CountSnapshots(&dc.volumes[i])
 		viidx++
 	}
-	dc.Close()
 	return vi, nil
 }
 
-func GetSnapshotInfo(device string, volumeName string) ([]SnapshotInfo, error) {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return nil, err
-	}
+func (d *Device) GetSnapshotInfo(volumeName string) ([]SnapshotInfo, error) {
+	d.lock.RLock()
+	defer d.lock.RUnlock()
+	dc := d.dc
 	v := dc.FindVolume(volumeName)
 	if v == nil {
 		return nil, fmt.Errorf("volume %v not found", volumeName)
@@ -159,23 +292,51 @@ func GetSnapshotInfo(device string, volumeName string) ([]SnapshotInfo, error) {
 		si[siidx].CreatedAt = time.Unix(dc.snapshots[sid-1].CreatedAt, 0)
 		siidx++
 	}
-	dc.Close()
 	return si, nil
 }
 
+func GetDeviceInfo(device string) (*DeviceInfo, error) {
+	var di *DeviceInfo
+	err := withDevice(device, func(d *Device) (err error) {
+		di, err = d.GetDeviceInfo()
+		return err
+	})
+	return di, err
+}
+
+func GetVolumeInfo(device string) ([]VolumeInfo, error) {
+	var vi []VolumeInfo
+	err := withDevice(device, func(d *Device) (err error) {
+		vi, err = d.GetVolumeInfo()
+		return err
+	})
+	return vi, err
+}
+
+func GetSnapshotInfo(device string, volumeName string) ([]SnapshotInfo, error) {
+	var si []SnapshotInfo
+	err := withDevice(device, func(d *Device) (err error) {
+		si, err = d.GetSnapshotInfo(volumeName)
+		return err
+	})
+	return si, err
+}
+
 // Management API
 
 func InitDevice(device string) error {
-	dc, err := NewDeviceContext(device)
+	return InitDeviceWithGeometry(device, Geometry{})
+}
+
+// Initialize a device with the given block and extent sizes, which cannot be changed afterwards. If a previous
+// initialization with the same geometry was interrupted, it is resumed.
+func InitDeviceWithGeometry(device string, g Geometry) error {
+	dc, err := NewDeviceContext(device, g)
 	if err != nil {
 		return err
 	}
-	eb := make([]ExtentMetadata, EXTENT_BATCH)
-	for offset := uint(0); offset < dc.totalDeviceExtents; offset += EXTENT_BATCH {
-		size := min(dc.totalDeviceExtents-offset, EXTENT_BATCH)
-		if err := dc.WriteExtents(eb[:size], offset); err != nil {
-			return err
-		}
+	if err := dc.clearExtents(); err != nil {
+		return err
 	}
 	if err := dc.WriteMetadata(); err != nil {
 		return err
@@ -187,50 +348,44 @@ func InitDevice(device string) error {
 }
 
 func VacuumDevice(device string) error {
-	return fmt.Errorf("not implemented")
+	return withDevice(device, func(d *Device) error {
+		_, err := d.Vacuum(VACUUM_BATCH, 0)
+		return err
+	})
 }
 
-func CreateVolume(device string, volumeName string, volumeSize uint64) error {
-	if volumeSize/EXTENT_SIZE == 0 {
+func (d *Device) CreateVolume(volumeName string, volumeSize uint64) error {
+	if volumeSize/uint64(d.dc.extentSize) == 0 {
 		return fmt.Errorf("volume with zero size")
 	}
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return err
-	}
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	dc := d.dc
 	if v := dc.FindVolume(volumeName); v != nil {
 		return fmt.Errorf("volume %v already exists", volumeName)
 	}
-	if _, err = dc.AddVolume(volumeName, volumeSize); err != nil {
-		return err
-	}
-	if err := dc.WriteMetadata(); err != nil {
+	if _, err := dc.AddVolume(volumeName, volumeSize); err != nil {
 		return err
 	}
-	return dc.Close()
+	return d.commit()
 }
 
-func RenameVolume(device string, volumeName string, newVolumeName string) error {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return err
-	}
+func (d *Device) RenameVolume(volumeName string, newVolumeName string) error {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	dc := d.dc
 	v := dc.FindVolume(volumeName)
 	if v == nil {
 		return fmt.Errorf("volume %v not found", volumeName)
 	}
-	v.setName(newVolumeName)
-	if err := dc.WriteMetadata(); err != nil {
-		return err
-	}
-	return dc.Close()
+	dc.SetVolumeName(v, newVolumeName)
+	return d.commit()
 }
 
-func CreateSnapshot(device string, volumeName string) error {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return err
-	}
+func (d *Device) CreateSnapshot(volumeName string) error {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	dc := d.dc
 	v := dc.FindVolume(volumeName)
 	if v == nil {
 		return fmt.Errorf("volume %v not found", volumeName)
@@ -239,76 +394,185 @@ func CreateSnapshot(device string, volumeName string) error {
 	if err != nil {
 		return err
 	}
-	v.SnapshotId = uint16(sid)
-	if err := dc.WriteMetadata(); err != nil {
-		return err
-	}
-	return dc.Close()
+	dc.SetVolumeSnapshot(v, sid)
+	return d.commit()
 }
 
-func CloneSnapshot(device string, newVolumeName string, snapshotId uint) error {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return err
+// Create a new volume from a snapshot, copying all data over.
+func (d *Device) CloneSnapshot(newVolumeName string, snapshotId uint) error {
+	return d.cloneSnapshot(newVolumeName, snapshotId, false)
+}
+
+// Create a new volume that shares the data of a snapshot, which becomes the parent of the clone's first snapshot,
+// so no data is copied. If the snapshot is the current snapshot of its volume, a new snapshot is taken for that
+// volume first.
+func (d *Device) CloneSnapshotLinked(newVolumeName string, snapshotId uint) error {
+	return d.cloneSnapshot(newVolumeName, snapshotId, true)
+}
+
+func (d *Device) cloneSnapshot(newVolumeName string, snapshotId uint, linked bool) error {
+	partial, err := d.addClone(newVolumeName, snapshotId, linked)
+	if partial != 0 {
+		// Drop the partial copy, as a failed import does
+		d.purgeSnapshots([]uint16{partial})
 	}
+	return err
+}
+
+// Add the volume of a clone. If copying data fails, the volume is removed again and its snapshot is returned,
+// to be purged without holding the device.
+func (d *Device) addClone(newVolumeName string, snapshotId uint, linked bool) (uint16, error) {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	dc := d.dc
 	vsrc := dc.FindVolumeWithSnapshot(uint16(snapshotId))
 	if vsrc == nil {
-		return fmt.Errorf("snapshot %v not found", snapshotId)
+		return 0, fmt.Errorf("snapshot %v not found", snapshotId)
+	}
+	if v := dc.FindVolume(newVolumeName); v != nil {
+		return 0, fmt.Errorf("volume %v already exists", newVolumeName)
+	}
+	if linked {
+		if vsrc.SnapshotId == uint16(snapshotId) {
+			sid, err := dc.AddSnapshot(vsrc.SnapshotId)
+			if err != nil {
+				return 0, err
+			}
+			dc.SetVolumeSnapshot(vsrc, sid)
+		}
+		vdst, err := dc.AddVolume(newVolumeName, vsrc.VolumeSize)
+		if err != nil {
+			return 0, err
+		}
+		dc.SetSnapshotParent(vdst.SnapshotId, uint16(snapshotId))
+		return 0, d.commit()
 	}
 	vem, err := GetVolumeExtentMap(dc, vsrc.VolumeSize, uint16(snapshotId))
 	if err != nil {
-		return err
+		return 0, err
+	}
+	free, err := dc.FreeExtents()
+	if err != nil {
+		return 0, err
 	}
-	if uint(dc.superblock.AllocatedDeviceExtents)+uint(vem.extentBitmap.Count()) > dc.totalDeviceExtents {
-		return fmt.Errorf("no space left on device")
+	if vem.Count() > free {
+		return 0, fmt.Errorf("no space left on device")
 	}
 	vdst, err := dc.AddVolume(newVolumeName, vsrc.VolumeSize)
 	if err != nil {
-		return err
+		return 0, err
 	}
-	if err := dc.WriteMetadata(); err != nil {
-		return err
+	sid := vdst.SnapshotId
+	err = dc.WriteMetadata()
+	if err == nil {
+		err = vem.CopyAllToSnapshot(sid)
 	}
-	if err := vem.CopyAllToSnapshot(vdst.SnapshotId); err != nil {
-		return err
+	if err == nil {
+		err = d.commit()
 	}
-	if err := dc.WriteSuperblock(); err != nil {
+	if err != nil {
+		dc.RemoveVolume(vdst)
+		return sid, err
+	}
+	return 0, nil
+}
+
+// Delete a volume along with its snapshots. Snapshots shared with linked clones are kept.
+func (d *Device) DeleteVolume(volumeName string) error {
+	sids, err := d.detachVolume(volumeName)
+	if err != nil {
 		return err
 	}
-	return dc.Close()
+	return d.purgeSnapshots(sids)
 }
 
-func DeleteVolume(device string, volumeName string) error {
-	dc, err := GetDeviceContext(device)
+// Delete a volume like DeleteVolume, but clear its extents in the background. The volume is gone and its name
+// can be reused when the call returns; its space is released later.
+func (d *Device) DeleteVolumeInBackground(volumeName string) error {
+	sids, err := d.detachVolume(volumeName)
 	if err != nil {
 		return err
 	}
+	d.purgeInBackground(sids)
+	return nil
+}
+
+// Remove a volume and detach the snapshots only it uses from the snapshot tree. Return the detached snapshots.
+func (d *Device) detachVolume(volumeName string) ([]uint16, error) {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	dc := d.dc
 	v := dc.FindVolume(volumeName)
 	if v == nil {
-		return fmt.Errorf("volume %v not found", volumeName)
+		return nil, fmt.Errorf("volume %v not found", volumeName)
 	}
-	for sid := v.SnapshotId; sid > 0; sid = dc.snapshots[sid-1].ParentSnapshotId {
-		sem, err := GetSnapshotExtentMap(dc, v.VolumeSize, sid)
-		if err != nil {
-			return err
-		}
-		if err := sem.ClearAll(); err != nil {
-			return err
-		}
-		dc.snapshots[sid-1].CreatedAt = 0
+	if _, ok := d.volumes[v]; ok {
+		return nil, fmt.Errorf("volume %v is open", volumeName)
 	}
-	*v = VolumeMetadata{}
-	if err := dc.WriteMetadata(); err != nil {
-		return err
+	var sids []uint16
+	for sid := v.SnapshotId; sid > 0; {
+		sids = append(sids, sid)
+		psid := dc.snapshots[sid-1].ParentSnapshotId
+		if psid != 0 && dc.CountChildSnapshots(psid) > 1 {
+			// The rest of the chain belongs to other volumes as well
+			dc.SetSnapshotParent(sid, 0)
+			break
+		}
+		sid = psid
 	}
-	return dc.Close()
+	dc.RemoveVolume(v)
+	return sids, d.commit()
 }
 
-func DeleteSnapshot(device string, snapshotId uint) error {
-	dc, err := GetDeviceContext(device)
+// Clear the extents of detached snapshots in a single metadata pass and then remove them. The pass runs without
+// the device lock, as nothing refers to the snapshots anymore.
+func (d *Device) purgeSnapshots(sids []uint16) error {
+	d.purgeLock.Lock()
+	defer d.purgeLock.Unlock()
+	dc := d.dc
+	purged := make([]bool, MAX_SNAPSHOTS+1)
+	for _, sid := range sids {
+		purged[sid] = true
+	}
+	var cleared []uint
+	err := dc.UpdateExtents(func(e *ExtentMetadata) bool {
+		return e.SnapshotId != 0 && purged[e.SnapshotId]
+	}, func(e *ExtentMetadata, epos uint) bool {
+		*e = ExtentMetadata{}
+		cleared = append(cleared, epos)
+		return true
+	})
 	if err != nil {
 		return err
 	}
+	dc.releaseClearedExtents(cleared)
+
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	for _, sid := range sids {
+		dc.RemoveSnapshot(sid)
+	}
+	return d.commit()
+}
+
+func (d *Device) purgeInBackground(sids []uint16) {
+	d.purges.Add(1)
+	go func() {
+		defer d.purges.Done()
+		if err := d.purgeSnapshots(sids); err != nil {
+			d.purgeLock.Lock()
+			if d.purgeErr == nil {
+				d.purgeErr = err
+			}
+			d.purgeLock.Unlock()
+		}
+	}()
+}
+
+func (d *Device) DeleteSnapshot(snapshotId uint) error {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	dc := d.dc
 	v := dc.FindVolumeWithSnapshot(uint16(snapshotId))
 	if v == nil {
 		return fmt.Errorf("snapshot %v not found", snapshotId)
@@ -316,110 +580,340 @@ func DeleteSnapshot(device string, snapshotId uint) error {
 	if v.SnapshotId == uint16(snapshotId) {
 		return fmt.Errorf("cannot delete current snapshot")
 	}
-	sem, err := GetSnapshotExtentMap(dc, v.VolumeSize, uint16(snapshotId))
-	if err != nil {
-		return err
-	}
 	childSnapshotId := dc.FindChildSnapshot(uint16(snapshotId))
 	if childSnapshotId == 0 {
 		return fmt.Errorf("cannot delete top-level snapshot")
 	}
-	cem, err := GetSnapshotExtentMap(dc, v.VolumeSize, childSnapshotId)
-	if err != nil {
-		return err
+	if dc.CountChildSnapshots(uint16(snapshotId)) > 1 {
+		return fmt.Errorf("cannot delete snapshot shared by linked clones")
 	}
-	if err := sem.MergeAllInto(cem, childSnapshotId); err != nil {
+	// Extents move even if the merge fails
+	d.generation++
+	if err := MergeSnapshot(dc, v.VolumeSize, uint16(snapshotId), childSnapshotId); err != nil {
 		return err
 	}
-	if err := sem.ClearAll(); err != nil {
+	dc.SetSnapshotParent(childSnapshotId, dc.snapshots[snapshotId-1].ParentSnapshotId)
+	dc.RemoveSnapshot(uint16(snapshotId))
+	if err := d.commit(); err != nil {
 		return err
 	}
-	dc.snapshots[childSnapshotId-1].ParentSnapshotId = dc.snapshots[snapshotId-1].ParentSnapshotId
-	dc.snapshots[snapshotId-1] = SnapshotMetadata{}
-	if err := dc.WriteMetadata(); err != nil {
-		return err
+	// Extents of open volumes may have moved to another snapshot
+	for _, vc := range d.volumes {
+		if dc.HasSnapshot(vc.volume, childSnapshotId) {
+			if err := vc.reload(); err != nil {
+				return err
+			}
+		}
 	}
-	return dc.Close()
+	return nil
+}
+
+func CreateVolume(device string, volumeName string, volumeSize uint64) error {
+	return withDevice(device, func(d *Device) error {
+		return d.CreateVolume(volumeName, volumeSize)
+	})
+}
+
+func RenameVolume(device string, volumeName string, newVolumeName string) error {
+	return withDevice(device, func(d *Device) error {
+		return d.RenameVolume(volumeName, newVolumeName)
+	})
+}
+
+func CreateSnapshot(device string, volumeName string) error {
+	return withDevice(device, func(d *Device) error {
+		return d.CreateSnapshot(volumeName)
+	})
+}
+
+func CloneSnapshot(device string, newVolumeName string, snapshotId uint) error {
+	return withDevice(device, func(d *Device) error {
+		return d.CloneSnapshot(newVolumeName, snapshotId)
+	})
+}
+
+func CloneSnapshotLinked(device string, newVolumeName string, snapshotId uint) error {
+	return withDevice(device, func(d *Device) error {
+		return d.CloneSnapshotLinked(newVolumeName, snapshotId)
+	})
+}
+
+func DeleteVolume(device string, volumeName string) error {
+	return withDevice(device, func(d *Device) error {
+		return d.DeleteVolume(volumeName)
+	})
+}
+
+func DeleteSnapshot(device string, snapshotId uint) error {
+	return withDevice(device, func(d *Device) error {
+		return d.DeleteSnapshot(snapshotId)
+	})
 }
 
 // Block API
 
+const (
+	EXTENT_LOCKS = 256
+)
+
+// The volume context is safe for concurrent use. Extents are protected by striped locks, selected by extent index,
+// so that I/O to unrelated extents proceeds in parallel. I/O also holds the device handle shared, so that management
+// operations never run in the middle of a request.
 type VolumeContext struct {
-	dc     *DeviceContext
-	volume *VolumeMetadata
-	vem    *ExtentMap
+	d         *Device
+	dc        *DeviceContext
+	volume    *VolumeMetadata
+	vem       *ExtentMap
+	locks     [EXTENT_LOCKS]sync.RWMutex
+	owner     bool          // The device handle was opened for this volume only
+	nextBlock atomic.Uint64 // Block following the last read, to detect sequential access
+	metrics   [METRIC_SHARDS]volumeCounters
 }
 
-var emptyBlock [BLOCK_SIZE]byte
-
-func OpenVolume(device string, volumeName string) (*VolumeContext, error) {
-	dc, err := GetDeviceContext(device)
-	if err != nil {
-		return nil, err
-	}
-	v := dc.FindVolume(volumeName)
+// Open a volume through the device handle. Each volume can only be opened once.
+func (d *Device) OpenVolume(volumeName string) (*VolumeContext, error) {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	v := d.dc.FindVolume(volumeName)
 	if v == nil {
 		return nil, fmt.Errorf("volume %v not found", volumeName)
 	}
-	vem, err := GetVolumeExtentMap(dc, v.VolumeSize, v.SnapshotId)
+	if _, ok := d.volumes[v]; ok {
+		return nil, fmt.Errorf("volume %v is already open", volumeName)
+	}
+	vem, err := GetVolumeExtentMap(d.dc, v.VolumeSize, v.SnapshotId)
 	if err != nil {
 		return nil, err
 	}
 	vc := &VolumeContext{
-		dc:     dc,
+		d:      d,
+		dc:     d.dc,
 		volume: v,
 		vem:    vem,
 	}
+	d.volumes[v] = vc
+	return vc, nil
+}
+
+func OpenVolume(device string, volumeName string) (*VolumeContext, error) {
+	d, err := OpenDevice(device)
+	if err != nil {
+		return nil, err
+	}
+	vc, err := d.OpenVolume(volumeName)
+	if err != nil {
+		d.Close()
+		return nil, err
+	}
+	vc.owner = true
 	return vc, nil
 }
 
+// Close the volume, writing out pending metadata updates. The device is also closed if it was opened along with
+// the volume.
 func (vc *VolumeContext) CloseVolume() error {
-	return vc.dc.Close()
+	d := vc.d
+	d.lock.Lock()
+	delete(d.volumes, vc.volume)
+	d.lock.Unlock()
+	if vc.owner {
+		return d.Close()
+	}
+	return vc.dc.Flush()
+}
+
+// Persist all pending metadata updates and flush the device.
+func (vc *VolumeContext) Sync() error {
+	return vc.dc.Sync()
+}
+
+// Rebuild the extent map after extents have been moved by a management operation.
+// Must be called with the device handle held exclusively.
+func (vc *VolumeContext) reload() error {
+	vem, err := GetVolumeExtentMap(vc.dc, vc.volume.VolumeSize, vc.volume.SnapshotId)
+	if err != nil {
+		return err
+	}
+	vc.vem = vem
+	return nil
+}
+
+// Get the lock protecting the extent that includes the given block.
+func (vc *VolumeContext) extentLock(block uint64) *sync.RWMutex {
+	return &vc.locks[(block>>vc.dc.blockBitsInExtent)%EXTENT_LOCKS]
 }
 
 func (vc *VolumeContext) ReadBlock(data []byte, block uint64) error {
-	eidx := uint(block >> BLOCK_BITS_IN_EXTENT)
-	if eidx > vc.vem.totalVolumeExtents {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	defer vc.countRead(block, int(vc.dc.blockSize), time.Now())
+	return vc.readBlock(data, block)
+}
+
+// Account for a read request, after it completes.
+func (vc *VolumeContext) countRead(block uint64, length int, start time.Time) {
+	m := vc.counters(block)
+	m.reads.Add(1)
+	m.readBytes.Add(uint64(length))
+	m.readLatency.observe(start)
+}
+
+// Account for a write request, after it completes.
+func (vc *VolumeContext) countWrite(block uint64, length int, start time.Time) {
+	m := vc.counters(block)
+	m.writes.Add(1)
+	m.writtenBytes.Add(uint64(length))
+	m.writeLatency.observe(start)
+}
+
+func (vc *VolumeContext) readBlock(data []byte, block uint64) error {
+	l := vc.extentLock(block)
+	l.RLock()
+	defer l.RUnlock()
+	return vc.readExtentBlocks(data[0:vc.dc.blockSize], block)
+}
+
+// Read consecutive blocks that belong to the same extent. Each run of allocated blocks is read with a single I/O,
+// while holes are zero-filled in place.
+func (vc *VolumeContext) readExtentBlocks(data []byte, block uint64) error {
+	eidx, bidx := vc.dc.blockPosition(block)
+	if eidx >= vc.vem.totalVolumeExtents {
 		return fmt.Errorf("block offset out of bounds")
 	}
-	e := &vc.vem.extents[eidx]
-	bidx := uint(block & BLOCK_MASK_IN_EXTENT)
-	bb := bitmap.FromBytes(e.BlockBitmap[:])
-	// Unallocated extent or block
-	if e.SnapshotId == 0 || !bb.Contains(uint32(bidx)) {
-		copy(data, emptyBlock[:])
+	e := vc.vem.lookup(uint32(eidx))
+	bs := vc.dc.blockSize
+	count := uint(len(data)) / bs
+	// Unallocated extent
+	if e == nil || e.SnapshotId == 0 {
+		clear(data)
+		vc.counters(block).holeBlocks.Add(uint64(count))
 		return nil
 	}
-	// Read data from device
-	if err := vc.dc.ReadBlockData(data, uint(e.ExtentPos), bidx); err != nil {
+	bb := bitmap.FromBytes(e.BlockBitmap[:])
+	if vc.dc.cache != nil {
+		return vc.readCachedBlocks(data, block, e, bb)
+	}
+	var reqs []*IORequest
+	holes := uint(0)
+	for i := uint(0); i < count; {
+		allocated := bb.Contains(uint32(bidx + i))
+		j := i + 1
+		for j < count && bb.Contains(uint32(bidx+j)) == allocated {
+			j++
+		}
+		run := data[i*bs : j*bs]
+		if !allocated {
+			// Unallocated blocks
+			clear(run)
+			holes += j - i
+		} else {
+			reqs = append(reqs, &IORequest{Data: run, Offset: vc.dc.blockDataOffset(uint(e.ExtentPos), bidx+i)})
+		}
+		i = j
+	}
+	if holes > 0 {
+		vc.counters(block).holeBlocks.Add(uint64(holes))
+	}
+	// Read data from device, issuing all runs at once
+	return vc.dc.SubmitBlocksData(reqs...)
+}
+
+// Read consecutive blocks of an allocated extent through the block cache. Each run of allocated blocks that are
+// not cached is read with a single I/O and added to the cache. On sequential access, up to CACHE_READAHEAD
+// allocated blocks past the end of the request are also read into the cache, without crossing the extent.
+func (vc *VolumeContext) readCachedBlocks(data []byte, block uint64, e *ExtentMetadata, bb bitmap.Bitmap) error {
+	cache := vc.dc.cache
+	epos := uint(e.ExtentPos)
+	_, bidx := vc.dc.blockPosition(block)
+	bs := vc.dc.blockSize
+	count := uint(len(data)) / bs
+	sequential := vc.nextBlock.Swap(block+uint64(count)) == block
+	var reqs []*IORequest
+	type run struct{ bidx, count uint }
+	var runs []run
+	holes, hits, misses := uint64(0), uint64(0), uint64(0)
+	for i := uint(0); i < count; {
+		if !bb.Contains(uint32(bidx + i)) {
+			clear(data[i*bs : (i+1)*bs])
+			holes++
+			i++
+			continue
+		}
+		if cache.get(vc.dc.dataBlock(epos, bidx+i), data[i*bs:(i+1)*bs]) {
+			hits++
+			i++
+			continue
+		}
+		// Extend the run up to the next hole or cached block
+		j := i + 1
+		for j < count && bb.Contains(uint32(bidx+j)) && !cache.contains(vc.dc.dataBlock(epos, bidx+j)) {
+			j++
+		}
+		reqs = append(reqs, &IORequest{Data: data[i*bs : j*bs], Offset: vc.dc.blockDataOffset(epos, bidx+i)})
+		runs = append(runs, run{bidx + i, j - i})
+		misses += uint64(j - i)
+		i = j
+	}
+	if holes > 0 {
+		vc.counters(block).holeBlocks.Add(holes)
+	}
+	vc.dc.metrics.cacheHits.Add(hits)
+	vc.dc.metrics.cacheMisses.Add(misses)
+	if sequential && len(runs) > 0 && runs[len(runs)-1].bidx+runs[len(runs)-1].count == bidx+count {
+		first, n := bidx+count, uint(0)
+		for n < CACHE_READAHEAD && first+n < vc.dc.blocksInExtent && bb.Contains(uint32(first+n)) && !cache.contains(vc.dc.dataBlock(epos, first+n)) {
+			n++
+		}
+		if n > 0 {
+			buf := getBuffer(int(n * bs))
+			defer buf.release()
+			reqs = append(reqs, &IORequest{Data: buf.b, Offset: vc.dc.blockDataOffset(epos, first)})
+			runs = append(runs, run{first, n})
+		}
+	}
+	if err := vc.dc.SubmitBlocksData(reqs...); err != nil {
 		return err
 	}
+	for i, r := range runs {
+		for k := uint(0); k < r.count; k++ {
+			cache.put(vc.dc.dataBlock(epos, r.bidx+k), reqs[i].Data[k*bs:(k+1)*bs])
+		}
+	}
 	return nil
 }
 
+// Read data at any offset. Whole blocks are read straight into the caller's buffer if it is aligned
+// (see AlignedBuffer); partial blocks go through pooled buffers.
 func (vc *VolumeContext) ReadAt(data []byte, offset uint64) error {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	bs := uint64(vc.dc.blockSize)
+	defer vc.countRead(offset/bs, len(data), time.Now())
 	doffset := uint64(0)
 	for remaining := uint64(len(data)); remaining > 0; remaining = uint64(len(data)) - doffset {
-		block := (offset + doffset) / BLOCK_SIZE
-		boffset := (offset + doffset) % BLOCK_SIZE
-		if boffset == 0 && remaining >= BLOCK_SIZE {
-			if err := vc.ReadBlock(data[doffset:doffset+BLOCK_SIZE], block); err != nil {
+		block := (offset + doffset) / bs
+		boffset := (offset + doffset) % bs
+		if boffset == 0 && remaining >= bs {
+			// Read as many whole blocks as possible, up to the end of the extent
+			dlength := min(remaining/bs, vc.dc.blocksLeftInExtent(block)) * bs
+			l := vc.extentLock(block)
+			l.RLock()
+			err := vc.readExtentBlocks(data[doffset:doffset+dlength], block)
+			l.RUnlock()
+			if err != nil {
 				return err
 			}
-			doffset += BLOCK_SIZE
+			doffset += dlength
 		} else {
-			buf := make([]byte, BLOCK_SIZE)
-			if err := vc.ReadBlock(buf, block); err != nil {
+			buf := getBuffer(int(bs))
+			if err := vc.readBlock(buf.b, block); err != nil {
+				buf.release()
 				return err
 			}
-			dlength := BLOCK_SIZE - boffset
-			if remaining < dlength {
-				copy(data[doffset:doffset+remaining], buf[boffset:boffset+remaining])
-				doffset += remaining
-			} else {
-				copy(data[doffset:doffset+dlength], buf[boffset:boffset+dlength])
-				doffset += dlength
-			}
+			dlength := min(remaining, bs-boffset)
+			copy(data[doffset:doffset+dlength], buf.b[boffset:boffset+dlength])
+			buf.release()
+			doffset += dlength
 		}
 	}
 	return nil
@@ -428,13 +922,27 @@ func (vc *VolumeContext) ReadAt(data []byte, offset uint64) error {
 var ErrMetadataNeedsUpdate = errors.New("metadata needs update")
 
 func (vc *VolumeContext) WriteBlock(data []byte, block uint64, updateMetadata bool) error {
-	eidx := uint(block >> BLOCK_BITS_IN_EXTENT)
-	if eidx > vc.vem.totalVolumeExtents {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	defer vc.countWrite(block, int(vc.dc.blockSize), time.Now())
+	l := vc.extentLock(block)
+	l.Lock()
+	defer l.Unlock()
+	return vc.writeExtentBlocks(data[0:vc.dc.blockSize], block, updateMetadata)
+}
+
+// Write consecutive blocks that belong to the same extent with a single I/O. The extent is allocated
+// (or copied over from a previous snapshot) at most once and its metadata is updated with a single write.
+// Copy-on-write only copies the allocated blocks of the previous extent that are not overwritten.
+func (vc *VolumeContext) writeExtentBlocks(data []byte, block uint64, updateMetadata bool) error {
+	eidx, bidx := vc.dc.blockPosition(block)
+	if eidx >= vc.vem.totalVolumeExtents {
 		return fmt.Errorf("block offset out of bounds")
 	}
-	e := &vc.vem.extents[eidx]
-	bidx := uint(block & BLOCK_MASK_IN_EXTENT)
+	e := vc.vem.entry(uint32(eidx))
+	count := uint(len(data)) / vc.dc.blockSize
 	bb := bitmap.FromBytes(e.BlockBitmap[:])
+	updated := false
 	// Unallocated or previous snapshot extent
 	if e.SnapshotId != vc.volume.SnapshotId {
 		if !updateMetadata {
@@ -446,80 +954,131 @@ func (vc *VolumeContext) WriteBlock(data []byte, block uint64, updateMetadata bo
 				return err
 			}
 		} else {
-			if err := vc.vem.CopyExtentToSnapshot(uint32(eidx), vc.volume.SnapshotId); err != nil {
+			// Copy the blocks not overwritten here, the metadata is written after the data
+			if err := vc.vem.copyExtent(uint32(eidx), vc.volume.SnapshotId, bidx, count); err != nil {
 				return err
 			}
+			vc.counters(block).copiedExtents.Add(1)
+			updated = true
 		}
-		// Update allocation count
-		if err := vc.dc.WriteSuperblock(); err != nil {
-			return err
-		}
-	} else {
-		if !bb.Contains(uint32(bidx)) && !updateMetadata {
-			return ErrMetadataNeedsUpdate
+	} else if !updateMetadata {
+		for i := uint(0); i < count; i++ {
+			if !bb.Contains(uint32(bidx + i)) {
+				return ErrMetadataNeedsUpdate
+			}
 		}
 	}
 	// Write data to device
-	if err := vc.dc.WriteBlockData(data, uint(e.ExtentPos), bidx); err != nil {
+	if err := vc.dc.WriteBlocksData(data, uint(e.ExtentPos), bidx); err != nil {
 		return err
 	}
 	// Update metadata
-	if bb.Contains(uint32(bidx)) {
+	for i := uint(0); i < count; i++ {
+		if !bb.Contains(uint32(bidx + i)) {
+			bb.Set(uint32(bidx + i))
+			updated = true
+		}
+	}
+	if !updated {
 		return nil
 	}
-	bb.Set(uint32(bidx))
 	if err := vc.vem.WriteExtent(uint32(eidx)); err != nil {
 		return err
 	}
 	return nil
 }
 
+// Write data at any offset. Whole blocks are written straight from the caller's buffer if it is aligned
+// (see AlignedBuffer); partial blocks go through pooled buffers.
 func (vc *VolumeContext) WriteAt(data []byte, offset uint64, updateMetadata bool) error {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	bs := uint64(vc.dc.blockSize)
+	defer vc.countWrite(offset/bs, len(data), time.Now())
 	doffset := uint64(0)
 	for remaining := uint64(len(data)); remaining > 0; remaining = uint64(len(data)) - doffset {
-		block := (offset + doffset) / BLOCK_SIZE
-		boffset := (offset + doffset) % BLOCK_SIZE
-		if boffset == 0 && remaining >= BLOCK_SIZE {
-			if err := vc.WriteBlock(data[doffset:doffset+BLOCK_SIZE], block, updateMetadata); err != nil {
+		block := (offset + doffset) / bs
+		boffset := (offset + doffset) % bs
+		if boffset == 0 && remaining >= bs {
+			// Write as many whole blocks as possible, up to the end of the extent
+			dlength := min(remaining/bs, vc.dc.blocksLeftInExtent(block)) * bs
+			l := vc.extentLock(block)
+			l.Lock()
+			err := vc.writeExtentBlocks(data[doffset:doffset+dlength], block, updateMetadata)
+			l.Unlock()
+			if err != nil {
 				return err
 			}
-			doffset += BLOCK_SIZE
+			doffset += dlength
 		} else {
-			buf := make([]byte, BLOCK_SIZE)
-			if err := vc.ReadBlock(buf, block); err != nil {
-				return err
-			}
-			dlength := BLOCK_SIZE - boffset
-			if remaining < dlength {
-				copy(buf[boffset:boffset+remaining], data[doffset:doffset+remaining])
-				doffset += remaining
-			} else {
-				copy(buf[boffset:boffset+dlength], data[doffset:doffset+dlength])
-				doffset += dlength
-			}
-			if err := vc.WriteBlock(buf, block, updateMetadata); err != nil {
+			dlength := min(remaining, bs-boffset)
+			if err := vc.writePartialBlock(data[doffset:doffset+dlength], block, boffset, updateMetadata); err != nil {
 				return err
 			}
+			doffset += dlength
 		}
 	}
 	return nil
 }
 
+// Update part of a block with a read-modify-write cycle, holding the extent lock throughout.
+func (vc *VolumeContext) writePartialBlock(data []byte, block uint64, boffset uint64, updateMetadata bool) error {
+	l := vc.extentLock(block)
+	l.Lock()
+	defer l.Unlock()
+	buf := getBuffer(int(vc.dc.blockSize))
+	defer buf.release()
+	if err := vc.readExtentBlocks(buf.b, block); err != nil {
+		return err
+	}
+	copy(buf.b[boffset:], data)
+	return vc.writeExtentBlocks(buf.b, block, updateMetadata)
+}
+
 func (vc *VolumeContext) UnmapBlock(block uint64) error {
-	eidx := uint(block >> BLOCK_BITS_IN_EXTENT)
-	if eidx > vc.vem.totalVolumeExtents {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	vc.counters(block).unmaps.Add(1)
+	return vc.unmapExtentBlocks(block, 1)
+}
+
+// Unmap consecutive blocks that belong to the same extent, with a single metadata update. Blocks held by a
+// previous snapshot are not touched; the rest of the extent is copied over instead, so that the unmapped blocks
+// are masked. An extent left empty is released, unless a previous snapshot may hold it, as it would show through.
+func (vc *VolumeContext) unmapExtentBlocks(block uint64, count uint) error {
+	l := vc.extentLock(block)
+	l.Lock()
+	defer l.Unlock()
+	eidx, bidx := vc.dc.blockPosition(block)
+	if eidx >= vc.vem.totalVolumeExtents {
 		return fmt.Errorf("block offset out of bounds")
 	}
-	e := &vc.vem.extents[eidx]
-	bidx := uint(block & BLOCK_MASK_IN_EXTENT)
+	e := vc.vem.lookup(uint32(eidx))
+	// Unallocated extent
+	if e == nil || e.SnapshotId == 0 {
+		return nil
+	}
 	bb := bitmap.FromBytes(e.BlockBitmap[:])
-	// Unallocated extent or block
-	if e.SnapshotId == 0 || !bb.Contains(uint32(bidx)) {
+	allocated := false
+	for i := bidx; i < bidx+count && !allocated; i++ {
+		allocated = bb.Contains(uint32(i))
+	}
+	// Unallocated blocks
+	if !allocated {
 		return nil
 	}
+	if e.SnapshotId != vc.volume.SnapshotId {
+		if err := vc.vem.copyExtent(uint32(eidx), vc.volume.SnapshotId, bidx, count); err != nil {
+			return err
+		}
+		vc.counters(block).copiedExtents.Add(1)
+	}
 	// Update metadata
-	bb.Remove(uint32(bidx))
-	if bb.Count() == 0 {
+	for i := bidx; i < bidx+count; i++ {
+		bb.Remove(uint32(i))
+	}
+	vc.dc.cache.invalidate(vc.dc.dataBlock(uint(e.ExtentPos), bidx), uint64(count))
+	if bb.Count() == 0 && vc.dc.snapshots[vc.volume.SnapshotId-1].ParentSnapshotId == 0 {
 		// Release if not used
 		e.SnapshotId = 0
 	}
@@ -529,24 +1088,66 @@ func (vc *VolumeContext) UnmapBlock(block uint64) error {
 	return nil
 }
 
+// Unmap a byte range. Each extent is updated once; partial blocks at either end are left as they are.
 func (vc *VolumeContext) UnmapAt(length uint64, offset uint64) error {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	return vc.unmapRange(length, offset, false)
+}
+
+// Zero a byte range. Whole blocks are unmapped, so that they take no space, while partial blocks at either end
+// are written.
+func (vc *VolumeContext) WriteZeroes(length uint64, offset uint64) error {
+	vc.d.lock.RLock()
+	defer vc.d.lock.RUnlock()
+	return vc.unmapRange(length, offset, true)
+}
+
+func (vc *VolumeContext) unmapRange(length uint64, offset uint64, zeroPartial bool) error {
+	bs := uint64(vc.dc.blockSize)
+	vc.counters(offset / bs).unmaps.Add(1)
 	doffset := uint64(0)
 	for remaining := length; remaining > 0; remaining = length - doffset {
-		block := (offset + doffset) / BLOCK_SIZE
-		boffset := (offset + doffset) % BLOCK_SIZE
-		if boffset == 0 && remaining >= BLOCK_SIZE {
-			if err := vc.UnmapBlock(block); err != nil {
+		block := (offset + doffset) / bs
+		boffset := (offset + doffset) % bs
+		if boffset == 0 && remaining >= bs {
+			// Unmap as many whole blocks as possible, up to the end of the extent
+			count := min(remaining/bs, vc.dc.blocksLeftInExtent(block))
+			if err := vc.unmapExtentBlocks(block, uint(count)); err != nil {
 				return err
 			}
-			doffset += BLOCK_SIZE
+			doffset += count * bs
 		} else {
-			dlength := BLOCK_SIZE - boffset
-			if remaining < dlength {
-				doffset += remaining
-			} else {
-				doffset += dlength
+			dlength := min(remaining, bs-boffset)
+			if zeroPartial {
+				if err := vc.zeroPartialBlock(block, boffset, dlength); err != nil {
+					return err
+				}
 			}
+			doffset += dlength
 		}
 	}
 	return nil
 }
+
+// Zero part of a block with a read-modify-write cycle, unless the block is not allocated.
+func (vc *VolumeContext) zeroPartialBlock(block uint64, boffset uint64, length uint64) error {
+	l := vc.extentLock(block)
+	l.Lock()
+	defer l.Unlock()
+	eidx, bidx := vc.dc.blockPosition(block)
+	if eidx >= vc.vem.totalVolumeExtents {
+		return fmt.Errorf("block offset out of bounds")
+	}
+	e := vc.vem.lookup(uint32(eidx))
+	if e == nil || e.SnapshotId == 0 || !bitmap.FromBytes(e.BlockBitmap[:]).Contains(uint32(bidx)) {
+		return nil
+	}
+	buf := getBuffer(int(vc.dc.blockSize))
+	defer buf.release()
+	if err := vc.readExtentBlocks(buf.b, block); err != nil {
+		return err
+	}
+	clear(buf.b[boffset : boffset+length])
+	return vc.writeExtentBlocks(buf.b, block, true)
+}
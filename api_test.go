@@ -15,13 +15,20 @@
 package dbs
 
 import (
+	"bytes"
+	"encoding/binary"
 	"fmt"
+	"io"
 	"os"
 	"runtime"
 	"sort"
+	"sync"
 	"testing"
 	"time"
+	"unsafe"
 
+	"github.com/kelindar/bitmap"
+	"github.com/ncw/directio"
 	"golang.org/x/exp/slices"
 	. "gopkg.in/check.v1"
 )
@@ -466,3 +473,1451 @@ func (s *TestSuite) TestSnapshotIO(c *C) {
 	err = DeleteVolume(DEVICE, "vol1clone")
 	c.Assert(err, IsNil)
 }
+
+func (s *TestSuite) TestVolumeRangeIO(c *C) {
+	blockData := loadBlocks()
+	pattern := make([]byte, 0, len(blockData)*BLOCK_SIZE)
+	for i := range blockData {
+		pattern = append(pattern, blockData[i]...)
+	}
+
+	// Create a volume and open it
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+
+	// Keep a copy of the expected volume contents
+	expected := make([]byte, 4*EXTENT_SIZE)
+	writes := []struct {
+		offset uint64
+		length uint64
+	}{
+		{0, EXTENT_SIZE}, // whole extent
+		{EXTENT_SIZE + 3*BLOCK_SIZE, 5 * BLOCK_SIZE},       // aligned blocks inside an extent
+		{2*EXTENT_SIZE - BLOCK_SIZE - 100, 3 * BLOCK_SIZE}, // unaligned across extents
+		{3*EXTENT_SIZE + 10, 100},                          // partial block
+	}
+	for _, w := range writes {
+		data := make([]byte, w.length)
+		for i := range data {
+			data[i] = pattern[(w.offset+uint64(i))%uint64(len(pattern))]
+		}
+		err = vc.WriteAt(data, w.offset, true)
+		c.Assert(err, IsNil)
+		copy(expected[w.offset:], data)
+	}
+
+	// Read back in one go, in large unaligned pieces and block by block
+	data := make([]byte, len(expected))
+	err = vc.ReadAt(data, 0)
+	c.Assert(err, IsNil)
+	c.Assert(data, DeepEquals, expected)
+	for offset := uint64(0); offset < uint64(len(expected)); offset += EXTENT_SIZE / 3 {
+		length := min(EXTENT_SIZE/3, uint64(len(expected))-offset)
+		err = vc.ReadAt(data[:length], offset)
+		c.Assert(err, IsNil)
+		c.Assert(data[:length], DeepEquals, expected[offset:offset+length])
+	}
+	for block := uint64(0); block < uint64(len(expected))/BLOCK_SIZE; block++ {
+		err = vc.ReadBlock(data[:BLOCK_SIZE], block)
+		c.Assert(err, IsNil)
+		c.Assert(data[:BLOCK_SIZE], DeepEquals, expected[block*BLOCK_SIZE:(block+1)*BLOCK_SIZE])
+	}
+
+	// Writes without metadata updates only succeed on allocated blocks
+	err = vc.WriteAt(pattern[:2*BLOCK_SIZE], EXTENT_SIZE+3*BLOCK_SIZE, false)
+	c.Assert(err, IsNil)
+	copy(expected[EXTENT_SIZE+3*BLOCK_SIZE:], pattern[:2*BLOCK_SIZE])
+	err = vc.WriteAt(pattern[:2*BLOCK_SIZE], EXTENT_SIZE+7*BLOCK_SIZE, false)
+	c.Assert(err, Equals, ErrMetadataNeedsUpdate)
+	vc.CloseVolume()
+
+	// Open again and read back
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	err = vc.ReadAt(data, 0)
+	c.Assert(err, IsNil)
+	c.Assert(data, DeepEquals, expected)
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestConcurrentIO(c *C) {
+	workers := 8
+	writes := 32
+
+	// Create a volume and open it
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+
+	// Each worker writes interleaved, partial blocks, so that extents and blocks are shared
+	chunk := uint64(BLOCK_SIZE / 4)
+	errs := make(chan error, workers)
+	var wg sync.WaitGroup
+	for w := 0; w < workers; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			data := make([]byte, chunk)
+			for i := range data {
+				data[i] = byte(w + 1)
+			}
+			for i := 0; i < writes; i++ {
+				offset := (uint64(i*workers+w) * chunk * 97) % (4 * EXTENT_SIZE)
+				if err := vc.WriteAt(data, offset-(offset%chunk), true); err != nil {
+					errs <- err
+					return
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		c.Assert(err, IsNil)
+	}
+
+	// Read back and verify
+	data := make([]byte, chunk)
+	for w := 0; w < workers; w++ {
+		for i := 0; i < writes; i++ {
+			offset := (uint64(i*workers+w) * chunk * 97) % (4 * EXTENT_SIZE)
+			err = vc.ReadAt(data, offset-(offset%chunk))
+			c.Assert(err, IsNil)
+			c.Assert(data[0], Equals, byte(w+1))
+			c.Assert(data[chunk-1], Equals, byte(w+1))
+		}
+	}
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestConcurrentAllocation(c *C) {
+	blockData := loadBlocks()
+	extents := 32
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+
+	// Neighboring extents are allocated at the same time, each looking at the others for a hint
+	var blockIndices []int
+	errs := make(chan error, extents)
+	var wg sync.WaitGroup
+	for i := 0; i < extents; i++ {
+		blockIndices = append(blockIndices, i*BLOCKS_IN_EXTENT)
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			errs <- vc.WriteBlock(blockData[i%len(blockData)], uint64(i*BLOCKS_IN_EXTENT), true)
+		}(i)
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		c.Assert(err, IsNil)
+	}
+	readBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	// So are the extents of a full copy
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	err = d.CloneSnapshot("vol2", snapshotInfo[0].SnapshotId)
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol2")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	for _, name := range []string{"vol1", "vol2"} {
+		err = d.DeleteVolume(name)
+		c.Assert(err, IsNil)
+	}
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestDeleteSnapshotIO(c *C) {
+	blockData := loadBlocks()
+	oldBlockIndices := []int{0, 1, 300, 301}
+	newBlockIndices := []int{2, 600, 601}
+
+	// Create a volume, write, snapshot and write to other blocks
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, oldBlockIndices, blockData)
+	vc.CloseVolume()
+	snapshotInfo, err := GetSnapshotInfo(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	initialSnapshotId := snapshotInfo[0].SnapshotId
+	err = CreateSnapshot(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, newBlockIndices, blockData[1:])
+	vc.CloseVolume()
+
+	// Delete the initial snapshot and read back everything
+	err = DeleteSnapshot(DEVICE, initialSnapshotId)
+	c.Assert(err, IsNil)
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, oldBlockIndices, blockData)
+	readBlocks(c, vc, newBlockIndices, blockData[1:])
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	deviceInfo, err := GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.VolumeCount, Equals, uint(0))
+}
+
+func (s *TestSuite) TestSnapshotChainIO(c *C) {
+	depth := 8
+	blockData := loadBlocks()
+
+	// Write to a shared block and a private block in every snapshot of the chain
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	for i := 0; i < depth; i++ {
+		if i > 0 {
+			err = CreateSnapshot(DEVICE, "vol1")
+			c.Assert(err, IsNil)
+		}
+		vc, err := OpenVolume(DEVICE, "vol1")
+		c.Assert(err, IsNil)
+		writeBlocks(c, vc, []int{7, (i + 1) * BLOCKS_IN_EXTENT}, [][]byte{blockData[i%len(blockData)]})
+		vc.CloseVolume()
+	}
+
+	// The nearest snapshot wins for the shared block, all private blocks are visible
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, []int{7}, [][]byte{blockData[(depth-1)%len(blockData)]})
+	for i := 0; i < depth; i++ {
+		readBlocks(c, vc, []int{(i + 1) * BLOCKS_IN_EXTENT}, [][]byte{blockData[i%len(blockData)]})
+	}
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestDeviceHandle(c *C) {
+	blockData := loadBlocks()
+	oldBlockIndices := []int{0, 1, 300, 301}
+	newBlockIndices := []int{2, 600, 601}
+
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	_, err = d.OpenVolume("vol1")
+	c.Assert(err, ErrorMatches, "volume vol1 is already open")
+
+	// Snapshot and delete the old snapshot while the volume is open
+	writeBlocks(c, vc, oldBlockIndices, blockData)
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	initialSnapshotId := snapshotInfo[0].SnapshotId
+	err = d.CreateSnapshot("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, newBlockIndices, blockData[1:])
+	err = d.DeleteSnapshot(initialSnapshotId)
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, oldBlockIndices, blockData)
+	readBlocks(c, vc, newBlockIndices, blockData[1:])
+
+	// Open volumes cannot be deleted and keep the device open
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, ErrorMatches, "volume vol1 is open")
+	err = d.Close()
+	c.Assert(err, ErrorMatches, "device has open volumes")
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+
+	// Changes are visible when reopening the device
+	volumeInfo, err := GetVolumeInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(volumeInfo, HasLen, 1)
+	assertVolume(c, &volumeInfo[0], "vol1", GIGABYTE, 1)
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, oldBlockIndices, blockData)
+	readBlocks(c, vc, newBlockIndices, blockData[1:])
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestSparseVolumeIO(c *C) {
+	blockData := loadBlocks()
+	volumeSize := uint64(64 * 1024 * GIGABYTE)
+	lastBlock := int(volumeSize/BLOCK_SIZE) - 1
+	blockIndices := []int{0, EXTENT_PAGE_ENTRIES * BLOCKS_IN_EXTENT, lastBlock}
+
+	// Only touched pages of a huge thin volume are populated
+	err := CreateVolume(DEVICE, "vol1", volumeSize)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	vc.CloseVolume()
+
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, blockIndices, blockData)
+	readBlocks(c, vc, []int{1, lastBlock - 1}, [][]byte{make([]byte, BLOCK_SIZE)})
+	c.Assert(vc.vem.Count(), Equals, uint(3))
+	pages := 0
+	for i := range vc.vem.pages {
+		if vc.vem.pages[i].Load() != nil {
+			pages++
+		}
+	}
+	c.Assert(pages, Equals, 3)
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	deviceInfo, err := GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.VolumeCount, Equals, uint(0))
+}
+
+func (s *TestSuite) TestDirectFileEngines(c *C) {
+	for _, engine := range []IOEngine{IO_ENGINE_SYNC, IO_ENGINE_URING} {
+		df, err := NewDirectFile(DEVICE, os.O_RDWR, 0660, engine)
+		c.Assert(err, IsNil)
+		c.Logf("%v engine in use for %v", df.Engine(), engine)
+
+		// Write a batch of aligned and unaligned buffers, then read it back
+		reqs := make([]*IORequest, 64)
+		for i := range reqs {
+			data := make([]byte, BLOCK_SIZE+1)[1:]
+			for j := range data {
+				data[j] = byte(i + j)
+			}
+			offset := uint64(DEVICE_SIZE - (i+1)*BLOCK_SIZE)
+			reqs[i] = &IORequest{Data: data, Offset: offset, Write: true}
+		}
+		err = df.SubmitAndWait(reqs...)
+		c.Assert(err, IsNil)
+		for i := range reqs {
+			reqs[i] = &IORequest{Data: directio.AlignedBlock(BLOCK_SIZE), Offset: reqs[i].Offset}
+		}
+		err = df.SubmitAndWait(reqs...)
+		c.Assert(err, IsNil)
+		for i := range reqs {
+			n, err := reqs[i].Wait()
+			c.Assert(err, IsNil)
+			c.Assert(n, Equals, BLOCK_SIZE)
+			c.Assert(reqs[i].Data[BLOCK_SIZE-1], Equals, byte(i+BLOCK_SIZE-1))
+		}
+
+		// Reads past the end are short
+		data := make([]byte, 2*BLOCK_SIZE)
+		n, err := df.ReadAt(data, DEVICE_SIZE-BLOCK_SIZE)
+		c.Assert(err, Equals, io.EOF)
+		c.Assert(n, Equals, BLOCK_SIZE)
+		c.Assert(df.Close(), IsNil)
+	}
+}
+
+func (s *TestSuite) TestMetadataModes(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1, BLOCKS_IN_EXTENT + 44}
+	defer func() { DefaultMetadataMode = METADATA_MODE_DIRECT }()
+
+	// Metadata written through the mapping is seen with direct I/O and vice versa
+	DefaultMetadataMode = METADATA_MODE_MMAP
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	c.Logf("%v metadata mode in use", d.dc.MetadataMode())
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+
+	DefaultMetadataMode = METADATA_MODE_DIRECT
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	c.Assert(vc.dc.MetadataMode(), Equals, METADATA_MODE_DIRECT)
+	readBlocks(c, vc, blockIndices, blockData)
+	err = vc.WriteBlock(blockData[0], 2, true)
+	c.Assert(err, IsNil)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	DefaultMetadataMode = METADATA_MODE_MMAP
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, []int{0, 1, 2, BLOCKS_IN_EXTENT + 44}, [][]byte{blockData[0], blockData[1], blockData[0], blockData[2]})
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestGroupCommit(c *C) {
+	blockData := loadBlocks()
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	blockIndices := []int{0, 1, 2, 3, 4, 5, 6, 7}
+	writeBlocks(c, vc, blockIndices, blockData)
+
+	// Syncs arriving while one is running share the next one
+	dc := vc.dc
+	start := dc.metrics.deviceSyncs.Load()
+	dc.metadataLock.Lock()
+	var wg sync.WaitGroup
+	for i := 0; i < 16; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			c.Check(vc.Sync(), IsNil)
+		}()
+	}
+	time.Sleep(50 * time.Millisecond)
+	dc.metadataLock.Unlock()
+	wg.Wait()
+	c.Assert(dc.metrics.deviceSyncs.Load()-start, Equals, uint64(2))
+	readBlocks(c, vc, blockIndices, blockData)
+
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestVolumeStats(c *C) {
+	blockData := loadBlocks()
+	c.Assert(unsafe.Sizeof(volumeCounters{})%64, Equals, uintptr(0))
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	blockIndices := []int{0, 1, 2, 3, 4, 5, 6, 7, BLOCKS_IN_EXTENT}
+	writeBlocks(c, vc, blockIndices, blockData)
+	readBlocks(c, vc, blockIndices, blockData)
+	data := make([]byte, BLOCK_SIZE)
+	err = vc.ReadBlock(data, 8)
+	c.Assert(err, IsNil)
+	err = vc.ReadAt(data, 2*EXTENT_SIZE)
+	c.Assert(err, IsNil)
+	err = vc.UnmapBlock(7)
+	c.Assert(err, IsNil)
+	err = vc.Sync()
+	c.Assert(err, IsNil)
+
+	stats := vc.Stats()
+	c.Assert(stats.Writes, Equals, uint64(9))
+	c.Assert(stats.WrittenBytes, Equals, uint64(9*BLOCK_SIZE))
+	c.Assert(stats.Reads, Equals, uint64(11))
+	c.Assert(stats.ReadBytes, Equals, uint64(11*BLOCK_SIZE))
+	c.Assert(stats.Unmaps, Equals, uint64(1))
+	c.Assert(stats.HoleBlocks, Equals, uint64(2))
+	c.Assert(stats.CopiedExtents, Equals, uint64(0))
+	c.Assert(stats.ReadLatency.Count, Equals, uint64(11))
+	c.Assert(stats.WriteLatency.Count, Equals, uint64(9))
+	c.Assert(vc.d.VolumeStats()["vol1"], DeepEquals, stats)
+	deviceStats := vc.d.Stats()
+	c.Assert(deviceStats.AllocatedExtents, Equals, uint64(2))
+	c.Assert(deviceStats.SyncRequests, Equals, uint64(1))
+	c.Assert(deviceStats.DeviceSyncs, Equals, uint64(1))
+	c.Assert(deviceStats.MetadataWrites > 0, Equals, true)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	// Writing after a snapshot copies the extent
+	err = CreateSnapshot(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, []int{1}, blockData)
+	stats = vc.Stats()
+	c.Assert(stats.Writes, Equals, uint64(1))
+	c.Assert(stats.CopiedExtents, Equals, uint64(1))
+	c.Assert(vc.d.Stats().AllocatedExtents, Equals, uint64(1))
+
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestBufferPool(c *C) {
+	for _, size := range []int{1, BLOCK_SIZE, BLOCK_SIZE + 1, EXTENT_SIZE, bufferClasses[len(bufferClasses)-1] + 1} {
+		buf := getBuffer(size)
+		c.Assert(buf.b, HasLen, size)
+		c.Assert(directio.IsAligned(buf.b), Equals, true)
+		buf.release()
+	}
+
+	// Partial block I/O with unaligned buffers round-trips through pooled buffers
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	data := make([]byte, 3*BLOCK_SIZE+1)[1:]
+	for i := range data {
+		data[i] = byte(i % 251)
+	}
+	err = vc.WriteAt(data, BLOCK_SIZE/2, true)
+	c.Assert(err, IsNil)
+	rdata := make([]byte, len(data)+1)[1:]
+	err = vc.ReadAt(rdata, BLOCK_SIZE/2)
+	c.Assert(err, IsNil)
+	c.Assert(rdata, DeepEquals, data)
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestBlockCache(c *C) {
+	// Keys in a single shard, each holding a block of its own value
+	bc := NewBlockCache(CACHE_SHARDS*16*BLOCK_SIZE, BLOCK_SIZE)
+	key := func(i int) uint64 { return uint64(i * CACHE_SHARDS) }
+	put := func(first int, count int) {
+		for i := first; i < first+count; i++ {
+			bc.put(key(i), bytes.Repeat([]byte{byte(i)}, BLOCK_SIZE))
+		}
+	}
+	hot := 100
+	put(hot, 4)
+	put(0, 16)
+	put(hot, 4)
+	data := make([]byte, BLOCK_SIZE)
+	c.Assert(bc.get(key(hot), data), Equals, true)
+	c.Assert(data[0], Equals, byte(hot))
+
+	// Blocks used again survive a scan
+	put(200, 50)
+	for i := hot; i < hot+4; i++ {
+		c.Assert(bc.contains(key(i)), Equals, true)
+	}
+	c.Assert(bc.contains(key(200)), Equals, false)
+	c.Assert(bc.Len(), Equals, 16)
+	bc.invalidate(key(hot), 1)
+	c.Assert(bc.contains(key(hot)), Equals, false)
+}
+
+func (s *TestSuite) TestCachedIO(c *C) {
+	DefaultCacheSize = 4 * MEGABYTE
+	defer func() { DefaultCacheSize = 0 }()
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1, 2, 3, 300}
+
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	err = d.CloneSnapshotLinked("vol1clone", snapshotInfo[0].SnapshotId)
+	c.Assert(err, IsNil)
+
+	// Sequential reads fill the cache ahead, which the clone shares
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, []int{0, 1}, blockData)
+	c.Assert(d.dc.cache.Len(), Equals, 4)
+	vcclone, err := d.OpenVolume("vol1clone")
+	c.Assert(err, IsNil)
+	readBlocks(c, vcclone, blockIndices, blockData)
+	c.Assert(d.dc.cache.Len(), Equals, 5)
+
+	// Writes relocate or overwrite cached blocks, unmaps hide them
+	writeBlocks(c, vc, []int{0}, blockData[1:])
+	readBlocks(c, vc, []int{0}, blockData[1:])
+	readBlocks(c, vcclone, []int{0}, blockData)
+	writeBlocks(c, vc, []int{0}, blockData[2:])
+	readBlocks(c, vc, []int{0}, blockData[2:])
+	readBlocks(c, vc, []int{1}, blockData[1:])
+	err = vc.UnmapBlock(1)
+	c.Assert(err, IsNil)
+	data := make([]byte, BLOCK_SIZE)
+	err = vc.ReadBlock(data, 1)
+	c.Assert(err, IsNil)
+	c.Assert(data, DeepEquals, make([]byte, BLOCK_SIZE))
+	readBlocks(c, vcclone, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = vcclone.CloseVolume()
+	c.Assert(err, IsNil)
+
+	err = d.DeleteVolume("vol1clone")
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestZeroIO(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1, 2, 3, BLOCKS_IN_EXTENT + 44}
+	zeroBlock := make([]byte, BLOCK_SIZE)
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+
+	// Zeroing all blocks of an extent releases it
+	writeBlocks(c, vc, blockIndices[:1], blockData)
+	err = vc.WriteZeroes(EXTENT_SIZE, 0)
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, blockIndices[:1], [][]byte{zeroBlock})
+	c.Assert(vc.vem.lookup(0).SnapshotId, Equals, uint16(0))
+
+	// Unmapping blocks of a previous snapshot masks them, leaving the snapshot as it is
+	writeBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.CreateSnapshot("vol1")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	err = vc.UnmapAt(2*BLOCK_SIZE+100, BLOCK_SIZE-50)
+	c.Assert(err, IsNil)
+	err = vc.WriteZeroes(EXTENT_SIZE, EXTENT_SIZE)
+	c.Assert(err, IsNil)
+	err = vc.WriteZeroes(200, 100)
+	c.Assert(err, IsNil)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	data := make([]byte, BLOCK_SIZE)
+	err = vc.ReadBlock(data, 0)
+	c.Assert(err, IsNil)
+	expected := bytes.Clone(blockData[0])
+	clear(expected[100:300])
+	c.Assert(data, DeepEquals, expected)
+	readBlocks(c, vc, blockIndices[1:3], [][]byte{zeroBlock})
+	readBlocks(c, vc, blockIndices[3:4], blockData[3:])
+	readBlocks(c, vc, blockIndices[4:], [][]byte{zeroBlock})
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	err = d.CloneSnapshotLinked("vol1clone", snapshotInfo[1].SnapshotId)
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol1clone")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	err = d.DeleteVolume("vol1clone")
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestSnapshotDiff(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1, 2, 3, BLOCKS_IN_EXTENT + 44}
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.CreateSnapshot("vol1")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, []int{5}, blockData)
+	err = vc.UnmapBlock(2)
+	c.Assert(err, IsNil)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	diff := func(snapshotId uint, baseSnapshotId uint) ([]BlockRange, error) {
+		var ranges []BlockRange
+		err := d.DiffSnapshots(snapshotId, baseSnapshotId, func(r BlockRange) error {
+			ranges = append(ranges, r)
+			return nil
+		})
+		return ranges, err
+	}
+	ranges, err := diff(snapshotInfo[0].SnapshotId, snapshotInfo[1].SnapshotId)
+	c.Assert(err, IsNil)
+	c.Assert(ranges, DeepEquals, []BlockRange{{0, 2, false}, {2, 1, true}, {3, 1, false}, {5, 1, false}})
+	ranges, err = diff(snapshotInfo[0].SnapshotId, 0)
+	c.Assert(err, IsNil)
+	c.Assert(ranges, DeepEquals, []BlockRange{{0, 2, false}, {3, 1, false}, {5, 1, false}, {BLOCKS_IN_EXTENT + 44, 1, false}})
+	ranges, err = diff(snapshotInfo[1].SnapshotId, 0)
+	c.Assert(err, IsNil)
+	c.Assert(ranges, DeepEquals, []BlockRange{{0, 4, false}, {BLOCKS_IN_EXTENT + 44, 1, false}})
+	_, err = diff(snapshotInfo[1].SnapshotId, snapshotInfo[0].SnapshotId)
+	c.Assert(err, NotNil)
+
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestExportImport(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1, 2, 3, BLOCKS_IN_EXTENT + 44}
+	zeroBlock := make([]byte, BLOCK_SIZE)
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.CreateSnapshot("vol1")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, []int{5}, blockData)
+	err = vc.UnmapBlock(2)
+	c.Assert(err, IsNil)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+
+	// Full streams only carry allocated blocks
+	var full bytes.Buffer
+	err = d.ExportSnapshot(&full, snapshotInfo[1].SnapshotId, 0, false)
+	c.Assert(err, IsNil)
+	c.Assert(full.Len(), Equals, SIZEOF_STREAM_HEADER+3*SIZEOF_STREAM_RECORD+len(blockIndices)*BLOCK_SIZE)
+	err = d.ImportVolume(&full, "vol2")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol2")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	// Incremental streams apply over the base
+	var incremental bytes.Buffer
+	err = d.ExportSnapshot(&incremental, snapshotInfo[0].SnapshotId, snapshotInfo[1].SnapshotId, true)
+	c.Assert(err, IsNil)
+	stream := incremental.Bytes()
+	err = d.ImportVolume(bytes.NewReader(stream), "vol3")
+	c.Assert(err, NotNil)
+	// Volumes of the same size without the base are rejected
+	err = d.CreateVolume("vol3", GIGABYTE)
+	c.Assert(err, IsNil)
+	err = d.ImportVolume(bytes.NewReader(stream), "vol3")
+	c.Assert(err, NotNil)
+	err = d.DeleteVolume("vol3")
+	c.Assert(err, IsNil)
+	err = d.ImportVolume(bytes.NewReader(stream), "vol2")
+	c.Assert(err, IsNil)
+	err = d.ImportVolume(bytes.NewReader(stream[:len(stream)-8]), "vol2")
+	c.Assert(err, NotNil)
+	vc, err = d.OpenVolume("vol2")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, []int{0, 1, 3, 5, BLOCKS_IN_EXTENT + 44}, [][]byte{blockData[0], blockData[1], blockData[3], blockData[0], blockData[4]})
+	readBlocks(c, vc, blockIndices[2:3], [][]byte{zeroBlock})
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	err = d.DeleteVolume("vol2")
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestImportTruncated(c *C) {
+	blockData := loadBlocks()
+	var blockIndices []int
+	for i := 0; i < STREAM_BATCH+2; i++ {
+		blockIndices = append(blockIndices, i*BLOCKS_IN_EXTENT)
+	}
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.CreateSnapshot("vol1")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData[1:])
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	var full, incremental bytes.Buffer
+	err = d.ExportSnapshot(&full, snapshotInfo[1].SnapshotId, 0, false)
+	c.Assert(err, IsNil)
+	err = d.ExportSnapshot(&incremental, snapshotInfo[0].SnapshotId, snapshotInfo[1].SnapshotId, true)
+	c.Assert(err, IsNil)
+	free, err := d.dc.FreeExtents()
+	c.Assert(err, IsNil)
+
+	// Batches written before the end of the stream are purged
+	err = d.ImportVolume(bytes.NewReader(full.Bytes()[:full.Len()-8]), "vol2")
+	c.Assert(err, NotNil)
+	volumeInfo, err := d.GetVolumeInfo()
+	c.Assert(err, IsNil)
+	c.Assert(len(volumeInfo), Equals, 1)
+	nfree, err := d.dc.FreeExtents()
+	c.Assert(err, IsNil)
+	c.Assert(nfree, Equals, free)
+
+	err = d.ImportVolume(bytes.NewReader(full.Bytes()), "vol2")
+	c.Assert(err, IsNil)
+	free, err = d.dc.FreeExtents()
+	c.Assert(err, IsNil)
+	err = d.ImportVolume(bytes.NewReader(incremental.Bytes()[:incremental.Len()-8]), "vol2")
+	c.Assert(err, NotNil)
+	snapshotInfo, err = d.GetSnapshotInfo("vol2")
+	c.Assert(err, IsNil)
+	c.Assert(len(snapshotInfo), Equals, 1)
+	nfree, err = d.dc.FreeExtents()
+	c.Assert(err, IsNil)
+	c.Assert(nfree, Equals, free)
+	err = d.Close()
+	c.Assert(err, IsNil)
+
+	d, err = OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindOrphanSnapshots(), HasLen, 0)
+	vc, err = d.OpenVolume("vol2")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, blockIndices, blockData)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol2")
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestGeometry(c *C) {
+	for _, g := range []Geometry{
+		{BlockSize: BLOCK_SIZE / 2},
+		{BlockSize: 3 * BLOCK_SIZE},
+		{BlockSize: 2 * MAX_BLOCK_SIZE},
+		{BlockSize: 4 * BLOCK_SIZE, ExtentSize: 2 * BLOCK_SIZE},
+		{ExtentSize: 2 * MAX_BLOCKS_IN_EXTENT * BLOCK_SIZE},
+	} {
+		c.Assert(InitDeviceWithGeometry(DEVICE, g), NotNil)
+	}
+
+	// Partial blocks, extent boundaries and copy-on-write with 16 KB blocks in 4 MB extents
+	g := Geometry{BlockSize: 4 * BLOCK_SIZE, ExtentSize: 4 * EXTENT_SIZE}
+	err := InitDeviceWithGeometry(DEVICE, g)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(d.Geometry(), Equals, g)
+	di, err := d.GetDeviceInfo()
+	c.Assert(err, IsNil)
+	c.Assert(di.Version, Equals, "1.1.0")
+	c.Assert(di.BlockSize, Equals, g.BlockSize)
+	c.Assert(di.ExtentSize, Equals, g.ExtentSize)
+	err = d.CreateVolume("vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	data := AlignedBuffer(int(2 * g.ExtentSize))
+	for i := range data {
+		data[i] = byte(i % 251)
+	}
+	offset := uint64(g.ExtentSize - 3*g.BlockSize + 100)
+	err = vc.WriteAt(data, offset, true)
+	c.Assert(err, IsNil)
+	rdata := AlignedBuffer(len(data))
+	err = vc.ReadAt(rdata, offset)
+	c.Assert(err, IsNil)
+	c.Assert(bytes.Equal(rdata, data), Equals, true)
+	block := make([]byte, g.BlockSize)
+	err = vc.ReadBlock(block, 0)
+	c.Assert(err, IsNil)
+	c.Assert(block, DeepEquals, make([]byte, g.BlockSize))
+	c.Assert(d.Stats().AllocatedExtents, Equals, uint64(3))
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.CreateSnapshot("vol1")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	blockIndex := uint64(g.ExtentSize/g.BlockSize) + 1
+	err = vc.WriteBlock(block, blockIndex, true)
+	c.Assert(err, IsNil)
+	c.Assert(vc.Stats().CopiedExtents, Equals, uint64(1))
+	err = vc.ReadAt(rdata, offset)
+	c.Assert(err, IsNil)
+	copy(data[blockIndex*uint64(g.BlockSize)-offset:], block)
+	c.Assert(bytes.Equal(rdata, data), Equals, true)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+
+	// Streams keep the geometry
+	snapshotInfo, err := d.GetSnapshotInfo("vol1")
+	c.Assert(err, IsNil)
+	var stream bytes.Buffer
+	err = d.ExportSnapshot(&stream, snapshotInfo[0].SnapshotId, 0, false)
+	c.Assert(err, IsNil)
+	err = d.ImportVolume(bytes.NewReader(stream.Bytes()), "vol2")
+	c.Assert(err, IsNil)
+	vc, err = d.OpenVolume("vol2")
+	c.Assert(err, IsNil)
+	err = vc.ReadAt(rdata, offset)
+	c.Assert(err, IsNil)
+	c.Assert(bytes.Equal(rdata, data), Equals, true)
+	err = vc.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+
+	err = InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err = OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.ImportVolume(bytes.NewReader(stream.Bytes()), "vol2")
+	c.Assert(err, NotNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestCopyOnWriteIO(c *C) {
+	blockData := loadBlocks()
+	parentBlockIndices := []int{0, 1, 2, 10, 200}
+
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, parentBlockIndices, blockData)
+	vc.CloseVolume()
+	err = CreateSnapshot(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+
+	// Overwrite a range covering some of the parent blocks and some holes
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	data := make([]byte, 4*BLOCK_SIZE)
+	for i := range data {
+		data[i] = 0xAA
+	}
+	err = vc.WriteAt(data, 1*BLOCK_SIZE, true)
+	c.Assert(err, IsNil)
+	e := vc.vem.lookup(0)
+	c.Assert(e.SnapshotId, Equals, vc.volume.SnapshotId)
+	c.Assert(bitmap.FromBytes(e.BlockBitmap[:]).Count(), Equals, 7)
+	readBlocks(c, vc, []int{0, 10, 200}, [][]byte{blockData[0], blockData[3%len(blockData)], blockData[4%len(blockData)]})
+	readBlocks(c, vc, []int{1, 2, 3, 4}, [][]byte{data[:BLOCK_SIZE]})
+	readBlocks(c, vc, []int{5, 100}, [][]byte{make([]byte, BLOCK_SIZE)})
+	vc.CloseVolume()
+
+	// The new extent survives reopening
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, []int{0, 1, 200}, [][]byte{blockData[0], data[:BLOCK_SIZE], blockData[4%len(blockData)]})
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestLinkedCloneIO(c *C) {
+	blockData := loadBlocks()
+	sharedBlockIndices := []int{0, 1, 300}
+
+	err := CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, sharedBlockIndices, blockData)
+	vc.CloseVolume()
+	deviceInfo, err := GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	allocatedDeviceExtents := deviceInfo.AllocatedDeviceExtents
+
+	// Cloning the current snapshot freezes it and copies nothing
+	snapshotInfo, err := GetSnapshotInfo(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	sharedSnapshotId := snapshotInfo[0].SnapshotId
+	err = CloneSnapshotLinked(DEVICE, "vol1clone", sharedSnapshotId)
+	c.Assert(err, IsNil)
+	deviceInfo, err = GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.AllocatedDeviceExtents, Equals, allocatedDeviceExtents)
+	snapshotInfo, err = GetSnapshotInfo(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	c.Assert(snapshotInfo, HasLen, 2)
+	snapshotInfo, err = GetSnapshotInfo(DEVICE, "vol1clone")
+	c.Assert(err, IsNil)
+	c.Assert(snapshotInfo, HasLen, 2)
+	c.Assert(snapshotInfo[0].ParentSnapshotId, Equals, sharedSnapshotId)
+
+	// Writes to either volume are private
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, []int{0}, blockData[1:])
+	vc.CloseVolume()
+	vc, err = OpenVolume(DEVICE, "vol1clone")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, sharedBlockIndices, blockData)
+	writeBlocks(c, vc, []int{1}, blockData[2:])
+	vc.CloseVolume()
+	vc, err = OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, []int{0, 1}, [][]byte{blockData[1], blockData[1]})
+	vc.CloseVolume()
+
+	// The shared snapshot cannot be merged, and survives deleting the source
+	err = DeleteSnapshot(DEVICE, sharedSnapshotId)
+	c.Assert(err, ErrorMatches, "cannot delete snapshot shared by linked clones")
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	vc, err = OpenVolume(DEVICE, "vol1clone")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, sharedBlockIndices, [][]byte{blockData[0], blockData[2], blockData[2]})
+	vc.CloseVolume()
+
+	// Now the old shared snapshot can be merged into the clone
+	err = DeleteSnapshot(DEVICE, sharedSnapshotId)
+	c.Assert(err, IsNil)
+	vc, err = OpenVolume(DEVICE, "vol1clone")
+	c.Assert(err, IsNil)
+	readBlocks(c, vc, sharedBlockIndices, [][]byte{blockData[0], blockData[2], blockData[2]})
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol1clone")
+	c.Assert(err, IsNil)
+	deviceInfo, err = GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.VolumeCount, Equals, uint(0))
+}
+
+func (s *TestSuite) TestVacuum(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1 * BLOCKS_IN_EXTENT, 2*BLOCKS_IN_EXTENT + 5, 3 * BLOCKS_IN_EXTENT}
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	err = CreateVolume(DEVICE, "vol2", GIGABYTE)
+	c.Assert(err, IsNil)
+
+	// Interleave allocations, then free the extents of one volume
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	vc1, err := d.OpenVolume("vol1")
+	c.Assert(err, IsNil)
+	vc2, err := d.OpenVolume("vol2")
+	c.Assert(err, IsNil)
+	for i := range blockIndices {
+		writeBlocks(c, vc1, blockIndices[i:i+1], blockData[i:])
+		writeBlocks(c, vc2, blockIndices[i:i+1], blockData[i+1:])
+	}
+	err = vc1.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+
+	// Vacuum while vol2 is open, then through a fresh handle
+	reclaimed, err := d.Vacuum(1, time.Millisecond)
+	c.Assert(err, IsNil)
+	c.Assert(reclaimed, Equals, uint(4))
+	deviceInfo, err := d.GetDeviceInfo()
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.AllocatedDeviceExtents, Equals, uint(4))
+	for i := range blockIndices {
+		readBlocks(c, vc2, blockIndices[i:i+1], blockData[i+1:])
+	}
+	writeBlocks(c, vc2, []int{4 * BLOCKS_IN_EXTENT}, blockData)
+	err = vc2.CloseVolume()
+	c.Assert(err, IsNil)
+	err = d.Close()
+	c.Assert(err, IsNil)
+
+	err = VacuumDevice(DEVICE)
+	c.Assert(err, IsNil)
+	deviceInfo, err = GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.AllocatedDeviceExtents, Equals, uint(5))
+	vc2, err = OpenVolume(DEVICE, "vol2")
+	c.Assert(err, IsNil)
+	for i := range blockIndices {
+		readBlocks(c, vc2, blockIndices[i:i+1], blockData[i+1:])
+	}
+	readBlocks(c, vc2, []int{4 * BLOCKS_IN_EXTENT}, blockData)
+	vc2.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol2")
+	c.Assert(err, IsNil)
+	err = VacuumDevice(DEVICE)
+	c.Assert(err, IsNil)
+	deviceInfo, err = GetDeviceInfo(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.AllocatedDeviceExtents, Equals, uint(0))
+}
+
+func (s *TestSuite) TestExtentReuse(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1 * BLOCKS_IN_EXTENT, 2 * BLOCKS_IN_EXTENT, 3 * BLOCKS_IN_EXTENT}
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = CreateVolume(DEVICE, "vol1", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err := OpenVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData)
+	vc.CloseVolume()
+	err = DeleteVolume(DEVICE, "vol1")
+	c.Assert(err, IsNil)
+
+	// Released extents are reused instead of growing the allocated area
+	err = CreateVolume(DEVICE, "vol2", GIGABYTE)
+	c.Assert(err, IsNil)
+	vc, err = OpenVolume(DEVICE, "vol2")
+	c.Assert(err, IsNil)
+	writeBlocks(c, vc, blockIndices, blockData[1:])
+	readBlocks(c, vc, blockIndices, blockData[1:])
+	deviceInfo, err := vc.d.GetDeviceInfo()
+	c.Assert(err, IsNil)
+	c.Assert(deviceInfo.AllocatedDeviceExtents, Equals, uint(4))
+	free, err := vc.dc.FreeExtents()
+	c.Assert(err, IsNil)
+	c.Assert(free, Equals, deviceInfo.TotalDeviceExtents-4)
+
+	// Consecutive volume extents are placed next to each other
+	for i := uint32(1); i < 4; i++ {
+		c.Assert(vc.vem.lookup(i).ExtentPos, Equals, vc.vem.lookup(i-1).ExtentPos+1)
+	}
+	vc.CloseVolume()
+
+	err = DeleteVolume(DEVICE, "vol2")
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestResumeInit(c *C) {
+	// Small extents, so that extent metadata spans several blocks
+	g := Geometry{ExtentSize: 16 * BLOCK_SIZE}
+	err := InitDeviceWithGeometry(DEVICE, g)
+	c.Assert(err, IsNil)
+	dc, err := NewDeviceContext(DEVICE, g)
+	c.Assert(err, IsNil)
+	eb := make([]ExtentMetadata, dc.totalDeviceExtents)
+	for i := range eb {
+		eb[i].SnapshotId = 1
+	}
+	err = dc.WriteExtents(eb, 0)
+	c.Assert(err, IsNil)
+	cleared := dc.totalDeviceExtents / 2
+	err = dc.checkpointInit(cleared)
+	c.Assert(err, IsNil)
+	err = dc.Close()
+	c.Assert(err, IsNil)
+
+	// An interrupted initialization leaves the device unusable, until resumed
+	_, err = GetDeviceInfo(DEVICE)
+	c.Assert(err, NotNil)
+	err = InitDeviceWithGeometry(DEVICE, g)
+	c.Assert(err, IsNil)
+	dc, err = GetDeviceContext(DEVICE)
+	c.Assert(err, IsNil)
+	err = dc.ReadExtents(eb, 0)
+	c.Assert(err, IsNil)
+	c.Assert(eb[0].SnapshotId, Equals, uint16(1))
+	for _, e := range eb[cleared:] {
+		c.Assert(e.SnapshotId, Equals, uint16(0))
+	}
+	err = dc.Close()
+	c.Assert(err, IsNil)
+
+	// A completed initialization starts over
+	err = InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	dc, err = GetDeviceContext(DEVICE)
+	c.Assert(err, IsNil)
+	eb = eb[:dc.totalDeviceExtents]
+	err = dc.ReadExtents(eb, 0)
+	c.Assert(err, IsNil)
+	for _, e := range eb {
+		c.Assert(e.SnapshotId, Equals, uint16(0))
+	}
+	err = dc.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestMetadataDirty(c *C) {
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	dc := d.dc
+	metadataWrites := func(fn func() error) uint64 {
+		start := d.Stats().MetadataWrites
+		c.Assert(fn(), IsNil)
+		c.Assert(dc.dirtyMetadata.Count(), Equals, 0)
+		return d.Stats().MetadataWrites - start
+	}
+
+	// Only the blocks holding changed entries are written
+	c.Assert(metadataWrites(func() error { return d.CreateVolume("vol0", GIGABYTE) }), Equals, uint64(2))
+	c.Assert(metadataWrites(func() error { return d.CreateSnapshot("vol0") }), Equals, uint64(2))
+	c.Assert(metadataWrites(func() error { return d.RenameVolume("vol0", "vol1") }), Equals, uint64(1))
+	c.Assert(metadataWrites(func() error { return d.Sync() }), Equals, uint64(0))
+
+	// Entries straddling a block boundary mark both blocks, written with a single I/O
+	for i := 1; i < BLOCK_SIZE/SIZEOF_VOLUME_METADATA; i++ {
+		err = d.CreateVolume(fmt.Sprintf("vol%v", i+1), GIGABYTE)
+		c.Assert(err, IsNil)
+	}
+	v, err := dc.AddVolume("vol16", GIGABYTE)
+	c.Assert(err, IsNil)
+	c.Assert(dc.volumeIndex(v)*SIZEOF_VOLUME_METADATA/BLOCK_SIZE, Equals, uint(0))
+	c.Assert(dc.dirtyMetadata.Contains(0), Equals, true)
+	c.Assert(dc.dirtyMetadata.Contains(1), Equals, true)
+	c.Assert(metadataWrites(dc.WriteMetadata), Equals, uint64(2))
+	straddles := func(sid uint16) bool {
+		offset := MAX_VOLUMES*SIZEOF_VOLUME_METADATA + (uint(sid)-1)*SIZEOF_SNAPSHOT_METADATA
+		return offset/BLOCK_SIZE != (offset+SIZEOF_SNAPSHOT_METADATA-1)/BLOCK_SIZE
+	}
+	for !straddles(v.SnapshotId + 1) {
+		err = d.CreateSnapshot("vol16")
+		c.Assert(err, IsNil)
+	}
+	sid, err := dc.AddSnapshot(v.SnapshotId)
+	c.Assert(err, IsNil)
+	c.Assert(straddles(sid), Equals, true)
+	c.Assert(dc.dirtyMetadata.Count(), Equals, 2)
+	c.Assert(metadataWrites(dc.WriteMetadata), Equals, uint64(1))
+	dc.SetVolumeSnapshot(v, sid)
+	c.Assert(metadataWrites(dc.WriteMetadata), Equals, uint64(1))
+
+	// Tables read back match the ones in memory
+	volumes, snapshots := dc.volumes, dc.snapshots
+	err = d.Close()
+	c.Assert(err, IsNil)
+	d, err = OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.volumes == volumes, Equals, true)
+	c.Assert(d.dc.snapshots == snapshots, Equals, true)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestMetadataIndex(c *C) {
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	for _, name := range []string{"vol1", "vol2", "vol3"} {
+		err = d.CreateVolume(name, GIGABYTE)
+		c.Assert(err, IsNil)
+		err = d.CreateSnapshot(name)
+		c.Assert(err, IsNil)
+	}
+	err = d.CreateSnapshot("vol2")
+	c.Assert(err, IsNil)
+	err = d.RenameVolume("vol3", "vol4")
+	c.Assert(err, IsNil)
+	snapshotInfo, err := d.GetSnapshotInfo("vol2")
+	c.Assert(err, IsNil)
+	err = d.CloneSnapshotLinked("vol2clone", snapshotInfo[1].SnapshotId)
+	c.Assert(err, IsNil)
+	err = d.CloneSnapshot("vol2copy", snapshotInfo[0].SnapshotId)
+	c.Assert(err, IsNil)
+	err = d.DeleteSnapshot(snapshotInfo[2].SnapshotId)
+	c.Assert(err, IsNil)
+	err = d.DeleteVolume("vol1")
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindVolume("vol3"), IsNil)
+	c.Assert(d.dc.FindVolume("vol4"), NotNil)
+	c.Assert(d.dc.FindVolumeWithSnapshot(uint16(snapshotInfo[1].SnapshotId)).VolumeName, Equals, d.dc.FindVolume("vol2").VolumeName)
+	c.Assert(d.dc.CountChildSnapshots(uint16(snapshotInfo[1].SnapshotId)), Equals, uint(2))
+	c.Assert(d.dc.CountVolumes(), Equals, uint(4))
+
+	// Freed slots are reused lowest first
+	err = d.CreateVolume("vol5", GIGABYTE)
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindVolume("vol5"), Equals, &d.dc.volumes[0])
+	c.Assert(d.dc.FindVolume("vol5").SnapshotId, Equals, uint16(1))
+
+	// Indexes kept up to date must match ones rebuilt from the device
+	err = d.Sync()
+	c.Assert(err, IsNil)
+	dc, err := GetDeviceContext(DEVICE)
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.index, DeepEquals, dc.index)
+	dc.Close()
+
+	for _, name := range []string{"vol2clone", "vol2copy", "vol2", "vol4", "vol5"} {
+		err = d.DeleteVolume(name)
+		c.Assert(err, IsNil)
+	}
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestDeleteVolumeInBackground(c *C) {
+	blockData := loadBlocks()
+	blockIndices := []int{0, 1 * BLOCKS_IN_EXTENT, 2*BLOCKS_IN_EXTENT + 5}
+
+	err := InitDevice(DEVICE)
+	c.Assert(err, IsNil)
+	d, err := OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	for _, name := range []string{"vol1", "vol2"} {
+		err = d.CreateVolume(name, GIGABYTE)
+		c.Assert(err, IsNil)
+		vc, err := d.OpenVolume(name)
+		c.Assert(err, IsNil)
+		writeBlocks(c, vc, blockIndices, blockData)
+		err = vc.CloseVolume()
+		c.Assert(err, IsNil)
+		err = d.CreateSnapshot(name)
+		c.Assert(err, IsNil)
+		vc, err = d.OpenVolume(name)
+		c.Assert(err, IsNil)
+		writeBlocks(c, vc, blockIndices[:1], blockData[1:])
+		err = vc.CloseVolume()
+		c.Assert(err, IsNil)
+	}
+
+	// The volume is gone right away and its space is released when done
+	err = d.DeleteVolumeInBackground("vol1")
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindVolume("vol1"), IsNil)
+	err = d.DeleteVolumeInBackground("vol1")
+	c.Assert(err, ErrorMatches, "volume vol1 not found")
+	err = d.WaitDeletions()
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindOrphanSnapshots(), HasLen, 0)
+	free, err := d.dc.FreeExtents()
+	c.Assert(err, IsNil)
+	c.Assert(free, Equals, d.dc.totalDeviceExtents-4)
+
+	// Snapshots detached by an interrupted deletion are purged on open
+	_, err = d.detachVolume("vol2")
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindOrphanSnapshots(), HasLen, 2)
+	err = d.Close()
+	c.Assert(err, IsNil)
+	d, err = OpenDevice(DEVICE)
+	c.Assert(err, IsNil)
+	err = d.WaitDeletions()
+	c.Assert(err, IsNil)
+	c.Assert(d.dc.FindOrphanSnapshots(), HasLen, 0)
+	free, err = d.dc.FreeExtents()
+	c.Assert(err, IsNil)
+	c.Assert(free, Equals, d.dc.totalDeviceExtents)
+	err = d.Close()
+	c.Assert(err, IsNil)
+}
+
+func (s *TestSuite) TestCodec(c *C) {
+	// Hand-written encoders must match the layout of encoding/binary
+	sb := Superblock{Version: VERSION, AllocatedDeviceExtents: 42, DeviceSize: DEVICE_SIZE}
+	copy(sb.Magic[:], MAGIC)
+	v := VolumeMetadata{SnapshotId: 7, VolumeSize: GIGABYTE}
+	v.setName("vol1")
+	sm := SnapshotMetadata{ParentSnapshotId: 3, CreatedAt: time.Now().Unix()}
+	e := ExtentMetadata{SnapshotId: 9, ExtentPos: 0x01020304}
+	for i := range e.BlockBitmap {
+		e.BlockBitmap[i] = byte(i * 3)
+	}
+	for _, t := range []struct {
+		value  interface{ encode([]byte) }
+		size   int
+		decode func([]byte) interface{}
+	}{
+		{&sb, SIZEOF_SUPERBLOCK, func(b []byte) interface{} { var x Superblock; x.decode(b); return &x }},
+		{&v, SIZEOF_VOLUME_METADATA, func(b []byte) interface{} { var x VolumeMetadata; x.decode(b); return &x }},
+		{&sm, SIZEOF_SNAPSHOT_METADATA, func(b []byte) interface{} { var x SnapshotMetadata; x.decode(b); return &x }},
+		{&e, SIZEOF_EXTENT_METADATA, func(b []byte) interface{} { var x ExtentMetadata; x.decode(b); return &x }},
+	} {
+		buf := new(bytes.Buffer)
+		err := binary.Write(buf, binary.LittleEndian, t.value)
+		c.Assert(err, IsNil)
+		c.Assert(buf.Len(), Equals, t.size)
+		b := make([]byte, t.size)
+		t.value.encode(b)
+		c.Assert(b, DeepEquals, buf.Bytes())
+		c.Assert(t.decode(b), DeepEquals, t.value)
+	}
+}
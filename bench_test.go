@@ -0,0 +1,465 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"math/rand"
+	"os"
+	"strconv"
+	"strings"
+	"testing"
+
+	"github.com/ncw/directio"
+)
+
+// Metadata codec benchmarks. The Reflect variants use encoding/binary, as the device code did originally.
+
+func BenchmarkExtentBatchDecode(b *testing.B) {
+	eb := make([]ExtentMetadata, EXTENT_BATCH)
+	buf := make([]byte, EXTENT_BATCH*SIZEOF_EXTENT_METADATA)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		decodeExtents(eb, buf)
+	}
+}
+
+func BenchmarkExtentBatchDecodeReflect(b *testing.B) {
+	eb := make([]ExtentMetadata, EXTENT_BATCH)
+	buf := make([]byte, EXTENT_BATCH*SIZEOF_EXTENT_METADATA)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if err := binary.Read(bytes.NewBuffer(buf), binary.LittleEndian, eb); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkExtentEncode(b *testing.B) {
+	var e ExtentMetadata
+	buf := make([]byte, SIZEOF_EXTENT_METADATA)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		e.encode(buf)
+	}
+}
+
+func BenchmarkExtentEncodeReflect(b *testing.B) {
+	var e ExtentMetadata
+	buf := make([]byte, SIZEOF_EXTENT_METADATA)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		w := new(bytes.Buffer)
+		if err := binary.Write(w, binary.LittleEndian, &e); err != nil {
+			b.Fatal(err)
+		}
+		copy(buf, w.Bytes())
+	}
+}
+
+func BenchmarkMetadataEncode(b *testing.B) {
+	var dc DeviceContext
+	buf := make([]byte, MAX_VOLUMES*SIZEOF_VOLUME_METADATA+MAX_SNAPSHOTS*SIZEOF_SNAPSHOT_METADATA)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		for j := range dc.volumes {
+			dc.volumes[j].encode(buf[j*SIZEOF_VOLUME_METADATA:])
+		}
+		sbuf := buf[MAX_VOLUMES*SIZEOF_VOLUME_METADATA:]
+		for j := range dc.snapshots {
+			dc.snapshots[j].encode(sbuf[j*SIZEOF_SNAPSHOT_METADATA:])
+		}
+	}
+}
+
+func BenchmarkMetadataEncodeReflect(b *testing.B) {
+	var dc DeviceContext
+	buf := make([]byte, MAX_VOLUMES*SIZEOF_VOLUME_METADATA+MAX_SNAPSHOTS*SIZEOF_SNAPSHOT_METADATA)
+	b.SetBytes(int64(len(buf)))
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		w := new(bytes.Buffer)
+		if err := binary.Write(w, binary.LittleEndian, dc.volumes); err != nil {
+			b.Fatal(err)
+		}
+		if err := binary.Write(w, binary.LittleEndian, dc.snapshots); err != nil {
+			b.Fatal(err)
+		}
+		copy(buf, w.Bytes())
+	}
+}
+
+// Block and management path benchmarks. Each runs on its own sparse device image, created in the working
+// directory, as direct I/O is not supported everywhere (e.g. on tmpfs). Besides allocations, benchmarks report
+// read and write system calls per operation where /proc/self/io is available; requests submitted through
+// io_uring are not included.
+
+const (
+	BENCH_DEVICE_SIZE = 256 * MEGABYTE
+	BENCH_VOLUME_SIZE = 64 * MEGABYTE
+)
+
+// Create and initialize a device image, removed when the benchmark finishes.
+func benchDevice(b *testing.B, size int64) string {
+	f, err := os.CreateTemp(".", "bench-*.img")
+	if err != nil {
+		b.Fatal(err)
+	}
+	name := f.Name()
+	b.Cleanup(func() { os.Remove(name) })
+	err = f.Truncate(size)
+	f.Close()
+	if err != nil {
+		b.Fatal(err)
+	}
+	if err := InitDevice(name); err != nil {
+		b.Fatal(err)
+	}
+	return name
+}
+
+// Open a device image with a volume, closing it when the benchmark finishes.
+func benchOpenDevice(b *testing.B, size int64, volumeSize uint64) *Device {
+	d, err := OpenDevice(benchDevice(b, size))
+	if err != nil {
+		b.Fatal(err)
+	}
+	b.Cleanup(func() {
+		if err := d.Close(); err != nil {
+			b.Error(err)
+		}
+	})
+	if err := d.CreateVolume("vol1", volumeSize); err != nil {
+		b.Fatal(err)
+	}
+	return d
+}
+
+// Write to a volume at the given stride, with one write of length bytes at each step.
+func benchFill(b *testing.B, d *Device, volumeName string, stride uint64, length int) {
+	vc, err := d.OpenVolume(volumeName)
+	if err != nil {
+		b.Fatal(err)
+	}
+	data := directio.AlignedBlock(length)
+	for i := range data {
+		data[i] = byte(i)
+	}
+	for offset := uint64(0); offset < vc.volume.VolumeSize; offset += stride {
+		if err := vc.WriteAt(data, offset, true); err != nil {
+			b.Fatal(err)
+		}
+	}
+	if err := vc.CloseVolume(); err != nil {
+		b.Fatal(err)
+	}
+}
+
+// Volume states for I/O benchmarks: nothing written, fully written, and fully written before a snapshot, so
+// that writes copy extents first. Write benchmarks take a new snapshot after each pass over the volume.
+var benchVolumeStates = []string{"fresh", "allocated", "snapshot"}
+
+func benchVolume(b *testing.B, state string) *VolumeContext {
+	d := benchOpenDevice(b, BENCH_DEVICE_SIZE, BENCH_VOLUME_SIZE)
+	if state != "fresh" {
+		benchFill(b, d, "vol1", EXTENT_SIZE, EXTENT_SIZE)
+	}
+	if state == "snapshot" {
+		if err := d.CreateSnapshot("vol1"); err != nil {
+			b.Fatal(err)
+		}
+	}
+	vc, err := d.OpenVolume("vol1")
+	if err != nil {
+		b.Fatal(err)
+	}
+	b.Cleanup(func() {
+		if err := vc.CloseVolume(); err != nil {
+			b.Error(err)
+		}
+	})
+	return vc
+}
+
+// Take a new snapshot of the benchmark volume, so that writes copy extents again, and delete the previous one,
+// so that the device does not fill up. The timer is stopped meanwhile.
+func benchResnapshot(b *testing.B, vc *VolumeContext) {
+	b.StopTimer()
+	defer b.StartTimer()
+	d := vc.d
+	previous := d.dc.snapshots[vc.volume.SnapshotId-1].ParentSnapshotId
+	if err := d.CreateSnapshot("vol1"); err != nil {
+		b.Fatal(err)
+	}
+	if previous != 0 {
+		if err := d.DeleteSnapshot(uint(previous)); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// Count read and write system calls of the process so far.
+func ioSyscalls() (uint64, bool) {
+	f, err := os.Open("/proc/self/io")
+	if err != nil {
+		return 0, false
+	}
+	defer f.Close()
+	count, found := uint64(0), 0
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		name, value, ok := strings.Cut(scanner.Text(), ": ")
+		if ok && (name == "syscr" || name == "syscw") {
+			n, err := strconv.ParseUint(value, 10, 64)
+			if err != nil {
+				return 0, false
+			}
+			count += n
+			found++
+		}
+	}
+	return count, found == 2
+}
+
+// Start measuring after setup. The returned function reports system calls per operation and must be called
+// when the benchmark loop is done.
+func benchStart(b *testing.B) func() {
+	b.ReportAllocs()
+	start, ok := ioSyscalls()
+	b.ResetTimer()
+	return func() {
+		b.StopTimer()
+		if end, eok := ioSyscalls(); ok && eok {
+			b.ReportMetric(float64(end-start)/float64(b.N), "syscalls/op")
+		}
+	}
+}
+
+func benchmarkVolumeIO(b *testing.B, size int, random bool, write bool) {
+	for _, state := range benchVolumeStates {
+		b.Run(state, func(b *testing.B) {
+			vc := benchVolume(b, state)
+			data := directio.AlignedBlock(size)
+			count := BENCH_VOLUME_SIZE / size
+			rng := rand.New(rand.NewSource(1))
+			b.SetBytes(int64(size))
+			defer benchStart(b)()
+			for i := 0; i < b.N; i++ {
+				if write && state == "snapshot" && i > 0 && i%count == 0 {
+					benchResnapshot(b, vc)
+				}
+				n := i % count
+				if random {
+					n = rng.Intn(count)
+				}
+				var err error
+				if write {
+					err = vc.WriteAt(data, uint64(n*size), true)
+				} else {
+					err = vc.ReadAt(data, uint64(n*size))
+				}
+				if err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+	}
+}
+
+func BenchmarkRandomRead4K(b *testing.B) {
+	benchmarkVolumeIO(b, BLOCK_SIZE, true, false)
+}
+
+func BenchmarkRandomWrite4K(b *testing.B) {
+	benchmarkVolumeIO(b, BLOCK_SIZE, true, true)
+}
+
+func BenchmarkSequentialRead1M(b *testing.B) {
+	benchmarkVolumeIO(b, EXTENT_SIZE, false, false)
+}
+
+func BenchmarkSequentialWrite1M(b *testing.B) {
+	benchmarkVolumeIO(b, EXTENT_SIZE, false, true)
+}
+
+// Random 4K I/O from concurrent clients sharing a volume context, as NBD connections do through the server
+// backend (which only forwards requests).
+func BenchmarkParallelIO(b *testing.B) {
+	for _, write := range []bool{false, true} {
+		name := "read"
+		if write {
+			name = "write"
+		}
+		b.Run(name, func(b *testing.B) {
+			vc := benchVolume(b, "allocated")
+			count := BENCH_VOLUME_SIZE / BLOCK_SIZE
+			b.SetBytes(BLOCK_SIZE)
+			defer benchStart(b)()
+			b.RunParallel(func(pb *testing.PB) {
+				data := directio.AlignedBlock(BLOCK_SIZE)
+				rng := rand.New(rand.NewSource(rand.Int63()))
+				for pb.Next() {
+					offset := uint64(rng.Intn(count) * BLOCK_SIZE)
+					var err error
+					if write {
+						err = vc.WriteAt(data, offset, true)
+					} else {
+						err = vc.ReadAt(data, offset)
+					}
+					if err != nil {
+						b.Error(err)
+						return
+					}
+				}
+			})
+		})
+	}
+}
+
+func benchmarkOpenVolume(b *testing.B, d *Device) {
+	defer benchStart(b)()
+	for i := 0; i < b.N; i++ {
+		vc, err := d.OpenVolume("vol1")
+		if err != nil {
+			b.Fatal(err)
+		}
+		if err := vc.CloseVolume(); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// Opening scans extent metadata, so it depends on the allocated part of the device and on the snapshot chain.
+func BenchmarkOpenVolume(b *testing.B) {
+	for _, size := range []int64{BENCH_DEVICE_SIZE, 4 * BENCH_DEVICE_SIZE} {
+		b.Run(fmt.Sprintf("device=%dMiB", size/MEGABYTE), func(b *testing.B) {
+			// Allocate half of the device, one block per extent
+			d := benchOpenDevice(b, size, uint64(size/2))
+			benchFill(b, d, "vol1", EXTENT_SIZE, BLOCK_SIZE)
+			benchmarkOpenVolume(b, d)
+		})
+	}
+	for _, depth := range []int{1, 16, 256} {
+		b.Run(fmt.Sprintf("depth=%d", depth), func(b *testing.B) {
+			// Each level copies an extent
+			d := benchOpenDevice(b, 4*BENCH_DEVICE_SIZE, BENCH_VOLUME_SIZE)
+			vc, err := d.OpenVolume("vol1")
+			if err != nil {
+				b.Fatal(err)
+			}
+			data := directio.AlignedBlock(BLOCK_SIZE)
+			for i := 0; i < depth; i++ {
+				if err := vc.WriteAt(data, uint64(i%(BENCH_VOLUME_SIZE/EXTENT_SIZE))*EXTENT_SIZE, true); err != nil {
+					b.Fatal(err)
+				}
+				if i < depth-1 {
+					if err := d.CreateSnapshot("vol1"); err != nil {
+						b.Fatal(err)
+					}
+				}
+			}
+			if err := vc.CloseVolume(); err != nil {
+				b.Fatal(err)
+			}
+			benchmarkOpenVolume(b, d)
+		})
+	}
+}
+
+func BenchmarkCreateSnapshot(b *testing.B) {
+	d := benchOpenDevice(b, BENCH_DEVICE_SIZE, BENCH_VOLUME_SIZE)
+	benchFill(b, d, "vol1", EXTENT_SIZE, BLOCK_SIZE)
+	defer benchStart(b)()
+	for i := 0; i < b.N; i++ {
+		// Stay away from the snapshot limit
+		if i > 0 && i%1024 == 0 {
+			b.StopTimer()
+			if err := d.DeleteVolume("vol1"); err != nil {
+				b.Fatal(err)
+			}
+			if err := d.CreateVolume("vol1", BENCH_VOLUME_SIZE); err != nil {
+				b.Fatal(err)
+			}
+			b.StartTimer()
+		}
+		if err := d.CreateSnapshot("vol1"); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// Each deletion merges a snapshot holding a written extent into its child.
+func BenchmarkDeleteSnapshot(b *testing.B) {
+	d := benchOpenDevice(b, BENCH_DEVICE_SIZE, BENCH_VOLUME_SIZE)
+	vc, err := d.OpenVolume("vol1")
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer vc.CloseVolume()
+	data := directio.AlignedBlock(BLOCK_SIZE)
+	defer benchStart(b)()
+	for i := 0; i < b.N; i++ {
+		b.StopTimer()
+		if err := vc.WriteAt(data, uint64(i%(BENCH_VOLUME_SIZE/EXTENT_SIZE))*EXTENT_SIZE, true); err != nil {
+			b.Fatal(err)
+		}
+		sid := uint(d.dc.FindVolume("vol1").SnapshotId)
+		if err := d.CreateSnapshot("vol1"); err != nil {
+			b.Fatal(err)
+		}
+		b.StartTimer()
+		if err := d.DeleteSnapshot(sid); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkCloneSnapshot(b *testing.B) {
+	for _, linked := range []bool{true, false} {
+		name := "copy"
+		if linked {
+			name = "linked"
+		}
+		b.Run(name, func(b *testing.B) {
+			d := benchOpenDevice(b, BENCH_DEVICE_SIZE, BENCH_VOLUME_SIZE)
+			benchFill(b, d, "vol1", EXTENT_SIZE, BLOCK_SIZE)
+			if err := d.CreateSnapshot("vol1"); err != nil {
+				b.Fatal(err)
+			}
+			sid := uint(d.dc.snapshots[d.dc.FindVolume("vol1").SnapshotId-1].ParentSnapshotId)
+			defer benchStart(b)()
+			for i := 0; i < b.N; i++ {
+				clone := d.CloneSnapshot
+				if linked {
+					clone = d.CloneSnapshotLinked
+				}
+				if err := clone("clone", sid); err != nil {
+					b.Fatal(err)
+				}
+				b.StopTimer()
+				if err := d.DeleteVolume("clone"); err != nil {
+					b.Fatal(err)
+				}
+				b.StartTimer()
+			}
+		})
+	}
+}
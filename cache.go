@@ -0,0 +1,219 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"sync"
+)
+
+const (
+	CACHE_SHARDS    = 16 // Independently locked parts of the block cache
+	CACHE_READAHEAD = 32 // Blocks read ahead within an extent on sequential access
+)
+
+// Block cache size of device handles, in bytes. Zero disables caching.
+var DefaultCacheSize uint64
+
+const (
+	queueIn   = iota // Blocks seen once, in FIFO order
+	queueMain        // Blocks seen again, in LRU order
+	queueOut         // Keys of blocks recently evicted from queueIn
+)
+
+type cacheEntry struct {
+	key        uint64
+	data       []byte // Nil for keys in queueOut
+	queue      int
+	prev, next *cacheEntry
+}
+
+// A doubly-linked list of entries, around a sentinel. New entries go to the front.
+type cacheQueue struct {
+	head cacheEntry
+	len  int
+}
+
+func (q *cacheQueue) init() {
+	q.head.prev, q.head.next = &q.head, &q.head
+}
+
+func (q *cacheQueue) pushFront(e *cacheEntry) {
+	e.prev, e.next = &q.head, q.head.next
+	q.head.next.prev = e
+	q.head.next = e
+	q.len++
+}
+
+func (q *cacheQueue) remove(e *cacheEntry) {
+	e.prev.next, e.next.prev = e.next, e.prev
+	e.prev, e.next = nil, nil
+	q.len--
+}
+
+func (q *cacheQueue) back() *cacheEntry {
+	return q.head.prev
+}
+
+type cacheShard struct {
+	lock     sync.Mutex
+	entries  map[uint64]*cacheEntry
+	queues   [3]cacheQueue
+	capacity int // Blocks held in queueIn and queueMain
+	spare    [][]byte
+}
+
+// A cache of device blocks, keyed by their position in the data area, so that volumes sharing extents share
+// cached blocks. Eviction follows 2Q: blocks enter a FIFO queue and only move to the LRU queue if accessed again
+// after leaving it, so a sequential scan cannot flush the blocks that are used repeatedly.
+//
+// Blocks must be invalidated whenever their data is written. Readers add blocks after reading them from the
+// device, which is safe as long as no one writes a block while it is being read; this holds, as extents are
+// either written through a single volume under its extent lock or frozen in a snapshot.
+type BlockCache struct {
+	shards    [CACHE_SHARDS]cacheShard
+	blockSize int
+}
+
+// Create a block cache of the given size in bytes, for blocks of the given size.
+func NewBlockCache(size uint64, blockSize uint) *BlockCache {
+	bc := &BlockCache{blockSize: int(blockSize)}
+	capacity := max(int(size/uint64(blockSize)/CACHE_SHARDS), 1)
+	for i := range bc.shards {
+		s := &bc.shards[i]
+		s.entries = make(map[uint64]*cacheEntry)
+		for q := range s.queues {
+			s.queues[q].init()
+		}
+		s.capacity = capacity
+	}
+	return bc
+}
+
+func (bc *BlockCache) shard(key uint64) *cacheShard {
+	return &bc.shards[key%CACHE_SHARDS]
+}
+
+// Copy a cached block into data. Returns false if the block is not cached.
+func (bc *BlockCache) get(key uint64, data []byte) bool {
+	s := bc.shard(key)
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	e, ok := s.entries[key]
+	if !ok || e.queue == queueOut {
+		return false
+	}
+	if e.queue == queueMain {
+		s.queues[queueMain].remove(e)
+		s.queues[queueMain].pushFront(e)
+	}
+	copy(data, e.data)
+	return true
+}
+
+// Check whether a block is cached, without counting it as an access.
+func (bc *BlockCache) contains(key uint64) bool {
+	s := bc.shard(key)
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	e, ok := s.entries[key]
+	return ok && e.queue != queueOut
+}
+
+// Add a block that has just been read from the device.
+func (bc *BlockCache) put(key uint64, data []byte) {
+	s := bc.shard(key)
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	e, ok := s.entries[key]
+	if ok && e.queue != queueOut {
+		copy(e.data, data)
+		return
+	}
+	queue := queueIn
+	if ok {
+		// Seen again after leaving queueIn
+		s.queues[queueOut].remove(e)
+		queue = queueMain
+	} else {
+		e = &cacheEntry{key: key}
+		s.entries[key] = e
+	}
+	if s.queues[queueIn].len+s.queues[queueMain].len >= s.capacity {
+		e.data = s.evict()
+	} else if n := len(s.spare); n > 0 {
+		e.data = s.spare[n-1]
+		s.spare = s.spare[:n-1]
+	} else {
+		e.data = make([]byte, bc.blockSize)
+	}
+	copy(e.data, data)
+	e.queue = queue
+	s.queues[queue].pushFront(e)
+}
+
+// Make room for a block, returning the buffer of the evicted one. queueIn is kept to a quarter of the capacity
+// and the keys of half the capacity are remembered in queueOut.
+func (s *cacheShard) evict() []byte {
+	var e *cacheEntry
+	if s.queues[queueIn].len > s.capacity/4 || s.queues[queueMain].len == 0 {
+		e = s.queues[queueIn].back()
+		s.queues[queueIn].remove(e)
+		e.queue = queueOut
+		s.queues[queueOut].pushFront(e)
+		if s.queues[queueOut].len > s.capacity/2 {
+			old := s.queues[queueOut].back()
+			s.queues[queueOut].remove(old)
+			delete(s.entries, old.key)
+		}
+	} else {
+		e = s.queues[queueMain].back()
+		s.queues[queueMain].remove(e)
+		delete(s.entries, e.key)
+	}
+	data := e.data
+	e.data = nil
+	return data
+}
+
+// Drop consecutive blocks from the cache. Safe to call on a nil cache.
+func (bc *BlockCache) invalidate(first uint64, count uint64) {
+	if bc == nil {
+		return
+	}
+	for key := first; key < first+count; key++ {
+		s := bc.shard(key)
+		s.lock.Lock()
+		if e, ok := s.entries[key]; ok {
+			s.queues[e.queue].remove(e)
+			delete(s.entries, key)
+			if e.data != nil {
+				s.spare = append(s.spare, e.data)
+			}
+		}
+		s.lock.Unlock()
+	}
+}
+
+// Get the number of blocks cached.
+func (bc *BlockCache) Len() int {
+	n := 0
+	for i := range bc.shards {
+		s := &bc.shards[i]
+		s.lock.Lock()
+		n += s.queues[queueIn].len + s.queues[queueMain].len
+		s.lock.Unlock()
+	}
+	return n
+}
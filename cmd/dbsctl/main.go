@@ -45,6 +45,8 @@ func cmdGetDeviceInfo(cmd *cli.Cmd) {
 			{"total_device_extents", di.TotalDeviceExtents},
 			{"allocated_device_extents", di.AllocatedDeviceExtents},
 			{"volume_count", di.VolumeCount},
+			{"block_size", units.BytesSize(float64(di.BlockSize))},
+			{"extent_size", units.BytesSize(float64(di.ExtentSize))},
 		})
 		t.Render()
 	}
@@ -104,8 +106,20 @@ func cmdGetSnapshotInfo(cmd *cli.Cmd) {
 }
 
 func cmdInitDevice(cmd *cli.Cmd) {
+	blockSize := cmd.StringOpt("b block-size", "4KiB", "Unit of copy-on-write (4KiB to 64KiB)")
+	extentSize := cmd.StringOpt("e extent-size", "1MiB", "Unit of allocation (1 to 256 blocks)")
 	cmd.Action = func() {
-		if err := dbs.InitDevice(*device); err != nil {
+		bs, err := units.RAMInBytes(*blockSize)
+		if err != nil {
+			fmt.Println(err)
+			return
+		}
+		es, err := units.RAMInBytes(*extentSize)
+		if err != nil {
+			fmt.Println(err)
+			return
+		}
+		if err := dbs.InitDeviceWithGeometry(*device, dbs.Geometry{BlockSize: uint(bs), ExtentSize: uint(es)}); err != nil {
 			fmt.Println(err)
 		}
 	}
@@ -156,8 +170,14 @@ func cmdCreateSnapshot(cmd *cli.Cmd) {
 func cmdCloneSnapshot(cmd *cli.Cmd) {
 	newVolumeName := cmd.StringArg("NEW_VOLUME_NAME", "", "")
 	snapshotId := cmd.IntArg("SNAPSHOT_ID", 0, "")
+	linked := cmd.BoolOpt("l linked", false, "Share data with the snapshot instead of copying it")
+	cmd.Spec = "[-l] NEW_VOLUME_NAME SNAPSHOT_ID"
 	cmd.Action = func() {
-		if err := dbs.CloneSnapshot(*device, *newVolumeName, uint(*snapshotId)); err != nil {
+		clone := dbs.CloneSnapshot
+		if *linked {
+			clone = dbs.CloneSnapshotLinked
+		}
+		if err := clone(*device, *newVolumeName, uint(*snapshotId)); err != nil {
 			fmt.Println(err)
 		}
 	}
@@ -181,6 +201,82 @@ func cmdDeleteSnapshot(cmd *cli.Cmd) {
 	}
 }
 
+func cmdDiffSnapshots(cmd *cli.Cmd) {
+	snapshotId := cmd.IntArg("SNAPSHOT_ID", 0, "")
+	baseSnapshotId := cmd.IntArg("BASE_SNAPSHOT_ID", 0, "Ancestor to compare against (0 for all data)")
+	cmd.Action = func() {
+		// Errors go to standard error, so that they are not taken for runs by tools reading the output
+		if err := diffSnapshots(uint(*snapshotId), uint(*baseSnapshotId)); err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(1)
+		}
+	}
+}
+
+func diffSnapshots(snapshotId uint, baseSnapshotId uint) error {
+	d, err := dbs.OpenDevice(*device)
+	if err != nil {
+		return err
+	}
+	defer d.Close()
+	di, err := d.GetDeviceInfo()
+	if err != nil {
+		return err
+	}
+	blockSize := uint64(di.BlockSize)
+	// One run per line, as byte offset, length and kind, so that output can be streamed to backup tools
+	return d.DiffSnapshots(snapshotId, baseSnapshotId, func(r dbs.BlockRange) error {
+		kind := "data"
+		if r.Zero {
+			kind = "zero"
+		}
+		_, err := fmt.Printf("%d\t%d\t%s\n", r.Block*blockSize, r.Count*blockSize, kind)
+		return err
+	})
+}
+
+func cmdExportSnapshot(cmd *cli.Cmd) {
+	snapshotId := cmd.IntArg("SNAPSHOT_ID", 0, "")
+	file := cmd.StringArg("FILE", "", "Output file (- for standard output)")
+	baseSnapshotId := cmd.IntOpt("b base", 0, "Only include changes since this ancestor")
+	compress := cmd.BoolOpt("z compress", false, "Compress the stream")
+	cmd.Action = func() {
+		w := os.Stdout
+		if *file != "-" {
+			f, err := os.Create(*file)
+			if err != nil {
+				fmt.Fprintln(os.Stderr, err)
+				return
+			}
+			defer f.Close()
+			w = f
+		}
+		if err := dbs.ExportSnapshot(*device, w, uint(*snapshotId), uint(*baseSnapshotId), *compress); err != nil {
+			fmt.Fprintln(os.Stderr, err)
+		}
+	}
+}
+
+func cmdImportVolume(cmd *cli.Cmd) {
+	volumeName := cmd.StringArg("VOLUME_NAME", "", "")
+	file := cmd.StringArg("FILE", "", "Input file (- for standard input)")
+	cmd.Action = func() {
+		r := os.Stdin
+		if *file != "-" {
+			f, err := os.Open(*file)
+			if err != nil {
+				fmt.Println(err)
+				return
+			}
+			defer f.Close()
+			r = f
+		}
+		if err := dbs.ImportVolume(*device, r, *volumeName); err != nil {
+			fmt.Println(err)
+		}
+	}
+}
+
 func main() {
 	app := cli.App("dbsctl", "DBS command line tool")
 	device = app.StringArg("DEVICE", "", "")
@@ -195,5 +291,8 @@ func main() {
 	app.Command("clone_snapshot", "", cmdCloneSnapshot)
 	app.Command("delete_volume", "", cmdDeleteVolume)
 	app.Command("delete_snapshot", "", cmdDeleteSnapshot)
+	app.Command("diff_snapshots", "", cmdDiffSnapshots)
+	app.Command("export_snapshot", "", cmdExportSnapshot)
+	app.Command("import_volume", "", cmdImportVolume)
 	app.Run(os.Args)
 }
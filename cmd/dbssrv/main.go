@@ -20,61 +20,222 @@ import (
 	"net"
 	"os"
 	"sync"
+	"sync/atomic"
+	"time"
 
 	nbd "github.com/chazapis/go-nbd/pkg/server"
+	"github.com/docker/go-units"
 	"github.com/jawher/mow.cli"
 	"golang.org/x/exp/slices"
 
 	"github.com/Kampadais/dbs"
 )
 
+const (
+	MAX_TRANSFER_SIZE = 32 * 1048576 // 32 MB
+	VACUUM_PAUSE      = 10 * time.Millisecond
+)
+
+// The backend serves concurrent requests without locking, as the volume context handles concurrency internally.
+// The volume is opened on first use and shared by all connections to the export.
 type NbdBackend struct {
-	sync.RWMutex
-	vc   *dbs.VolumeContext
-	size uint64
+	d          *dbs.Device
+	volumeName string
+	size       uint64
+	vc         atomic.Pointer[dbs.VolumeContext]
+	lock       sync.Mutex // Serializes opening the volume
 }
 
-func NewNbdBackend(vc *dbs.VolumeContext, size uint64) *NbdBackend {
+func NewNbdBackend(d *dbs.Device, volumeName string, size uint64) *NbdBackend {
 	return &NbdBackend{
-		vc:   vc,
-		size: size,
+		d:          d,
+		volumeName: volumeName,
+		size:       size,
+	}
+}
+
+func (b *NbdBackend) volume() (*dbs.VolumeContext, error) {
+	if vc := b.vc.Load(); vc != nil {
+		return vc, nil
+	}
+	b.lock.Lock()
+	defer b.lock.Unlock()
+	if vc := b.vc.Load(); vc != nil {
+		return vc, nil
+	}
+	vc, err := b.d.OpenVolume(b.volumeName)
+	if err != nil {
+		return nil, err
 	}
+	b.vc.Store(vc)
+	return vc, nil
 }
 
+// Requests are passed to the library as a whole, which coalesces them into as few device I/Os as possible.
 func (b *NbdBackend) ReadAt(p []byte, off int64) (n int, err error) {
-	b.RLock()
-	defer b.RUnlock()
-	return len(p), b.vc.ReadAt(p, uint64(off))
+	vc, err := b.volume()
+	if err != nil {
+		return 0, err
+	}
+	if err := vc.ReadAt(p, uint64(off)); err != nil {
+		return 0, err
+	}
+	return len(p), nil
 }
 
 func (b *NbdBackend) WriteAt(p []byte, off int64) (n int, err error) {
-	b.Lock()
-	defer b.Unlock()
-	return len(p), b.vc.WriteAt(p, uint64(off))
+	vc, err := b.volume()
+	if err != nil {
+		return 0, err
+	}
+	if err := vc.WriteAt(p, uint64(off), true); err != nil {
+		return 0, err
+	}
+	return len(p), nil
 }
 
 func (b *NbdBackend) Size() (int64, error) {
 	return int64(b.size), nil
 }
 
+// Make completed writes durable (NBD_CMD_FLUSH). Flushes from all connections are grouped by the library, so
+// concurrent clients share device flushes instead of paying one each.
 func (b *NbdBackend) Sync() error {
-	return nil
+	vc := b.vc.Load()
+	if vc == nil {
+		return nil
+	}
+	return vc.Sync()
 }
 
-func startServer(url *string, device *string, volumeName *string) error {
-	volumeInfo, err := dbs.GetVolumeInfo(*device)
+func (b *NbdBackend) Close() error {
+	vc := b.vc.Load()
+	if vc == nil {
+		return nil
+	}
+	return vc.CloseVolume()
+}
+
+// Parse and validate the transfer sizes advertised to clients.
+func parseBlockSizes(preferredSize string, maximumSize string) (uint32, uint32, error) {
+	preferred, err := units.RAMInBytes(preferredSize)
+	if err != nil {
+		return 0, 0, err
+	}
+	maximum, err := units.RAMInBytes(maximumSize)
+	if err != nil {
+		return 0, 0, err
+	}
+	if preferred < dbs.BLOCK_SIZE || preferred&(preferred-1) != 0 {
+		return 0, 0, fmt.Errorf("preferred block size must be a power of two and at least %v", dbs.BLOCK_SIZE)
+	}
+	if maximum < preferred || maximum%dbs.BLOCK_SIZE != 0 {
+		return 0, 0, fmt.Errorf("maximum block size must be a multiple of %v and at least the preferred block size", dbs.BLOCK_SIZE)
+	}
+	if maximum > MAX_TRANSFER_SIZE {
+		return 0, 0, fmt.Errorf("maximum block size larger than %v", units.BytesSize(MAX_TRANSFER_SIZE))
+	}
+	return uint32(preferred), uint32(maximum), nil
+}
+
+// Build one export per volume, named after it. All volumes are served if none are given. A single volume is also
+// published as the default (unnamed) export.
+func buildExports(d *dbs.Device, volumeNames []string) ([]*nbd.Export, []*NbdBackend, error) {
+	volumeInfo, err := d.GetVolumeInfo()
+	if err != nil {
+		return nil, nil, err
+	}
+	if len(volumeNames) == 0 {
+		for _, vi := range volumeInfo {
+			volumeNames = append(volumeNames, vi.VolumeName)
+		}
+	}
+	exports := make([]*nbd.Export, 0, len(volumeNames)+1)
+	backends := make([]*NbdBackend, 0, len(volumeNames))
+	for _, volumeName := range volumeNames {
+		volumeIdx := slices.IndexFunc(volumeInfo, func(vi dbs.VolumeInfo) bool { return vi.VolumeName == volumeName })
+		if volumeIdx == -1 {
+			return nil, nil, fmt.Errorf("volume %v not found", volumeName)
+		}
+		backend := NewNbdBackend(d, volumeName, volumeInfo[volumeIdx].VolumeSize)
+		backends = append(backends, backend)
+		exports = append(exports, &nbd.Export{
+			Name:        volumeName,
+			Description: "DBS",
+			Backend:     backend,
+		})
+	}
+	if len(backends) == 0 {
+		return nil, nil, fmt.Errorf("no volumes to serve")
+	}
+	if len(backends) == 1 {
+		exports = append(exports, &nbd.Export{
+			Name:        "",
+			Description: "DBS",
+			Backend:     backends[0],
+		})
+	}
+	return exports, backends, nil
+}
+
+// Reclaim free extents periodically, pausing between vacuum steps to limit the impact on I/O.
+func vacuumDevice(d *dbs.Device, interval time.Duration) {
+	for {
+		time.Sleep(interval)
+		reclaimed, err := d.Vacuum(dbs.VACUUM_BATCH, VACUUM_PAUSE)
+		if err != nil {
+			fmt.Printf("Failed to vacuum device: %v\n", err)
+		} else if reclaimed > 0 {
+			fmt.Printf("Vacuum reclaimed %v extents\n", reclaimed)
+		}
+	}
+}
+
+func startServer(url *string, device *string, volumeNames *[]string, preferredSize *string, maximumSize *string, ioEngine *string, metadataMode *string, cacheSize *string, vacuumInterval *string, metricsAddress *string) error {
+	preferredBlockSize, maximumBlockSize, err := parseBlockSizes(*preferredSize, *maximumSize)
 	if err != nil {
 		return err
 	}
-	volumeIdx := slices.IndexFunc(volumeInfo, func(vi dbs.VolumeInfo) bool { return vi.VolumeName == *volumeName })
-	if volumeIdx == -1 {
-		return fmt.Errorf("volume %v not found", volumeName)
+	if dbs.DefaultIOEngine, err = dbs.ParseIOEngine(*ioEngine); err != nil {
+		return err
+	}
+	if dbs.DefaultMetadataMode, err = dbs.ParseMetadataMode(*metadataMode); err != nil {
+		return err
+	}
+	if *cacheSize != "" {
+		size, err := units.RAMInBytes(*cacheSize)
+		if err != nil {
+			return err
+		}
+		dbs.DefaultCacheSize = uint64(size)
+	}
+	d, err := dbs.OpenDevice(*device)
+	if err != nil {
+		return err
 	}
-	vc, err := dbs.OpenVolume(*device, *volumeName)
+	defer d.Close()
+	// Smaller requests to devices with larger blocks need read-modify-write cycles
+	preferredBlockSize = max(preferredBlockSize, uint32(d.Geometry().BlockSize))
+	maximumBlockSize = max(maximumBlockSize, preferredBlockSize)
+	exports, backends, err := buildExports(d, *volumeNames)
 	if err != nil {
 		return err
 	}
-	backend := NewNbdBackend(vc, volumeInfo[volumeIdx].VolumeSize)
+	if *vacuumInterval != "" {
+		interval, err := time.ParseDuration(*vacuumInterval)
+		if err != nil {
+			return err
+		}
+		go vacuumDevice(d, interval)
+	}
+	if *metricsAddress != "" {
+		go serveMetrics(d, *metricsAddress)
+	}
+	defer func() {
+		for _, backend := range backends {
+			backend.Close()
+		}
+	}()
 
 	listener, err := net.Listen("tcp", *url)
 	if err != nil {
@@ -94,18 +255,12 @@ func startServer(url *string, device *string, volumeName *string) error {
 
 			if err := nbd.Handle(
 				conn,
-				[]*nbd.Export{
-					{
-						Name:        "",
-						Description: "DBS",
-						Backend:     backend,
-					},
-				},
+				exports,
 				&nbd.Options{
 					ReadOnly:           false,
 					MinimumBlockSize:   dbs.BLOCK_SIZE,
-					PreferredBlockSize: dbs.BLOCK_SIZE,
-					MaximumBlockSize:   dbs.BLOCK_SIZE,
+					PreferredBlockSize: preferredBlockSize,
+					MaximumBlockSize:   maximumBlockSize,
 				}); err != nil {
 				fmt.Printf("Failed to handle nbd connection: %v\n", err)
 			}
@@ -116,10 +271,18 @@ func startServer(url *string, device *string, volumeName *string) error {
 func main() {
 	app := cli.App("dbssrv", "NBD server for DBS")
 	url := app.StringOpt("u url", "localhost:10809", "Server URL")
+	preferredSize := app.StringOpt("p preferred-block-size", "4KiB", "Preferred transfer size advertised to clients")
+	maximumSize := app.StringOpt("m maximum-block-size", "1MiB", "Maximum transfer size advertised to clients")
+	ioEngine := app.StringOpt("e io-engine", "sync", "Device I/O engine (sync or uring)")
+	metadataMode := app.StringOpt("metadata-mode", "direct", "Device metadata access (direct or mmap, for devices on regular files)")
+	cacheSize := app.StringOpt("c cache-size", "", "Size of the block cache shared by all volumes (e.g. 1GiB, default: no cache)")
+	vacuumInterval := app.StringOpt("vacuum-interval", "", "Reclaim free extents in the background at this interval (e.g. 1h)")
+	metricsAddress := app.StringOpt("metrics-address", "", "Serve metrics (/metrics, /debug/vars) and profiles (/debug/pprof) over HTTP at this address (e.g. localhost:9100)")
+	app.Spec = "[OPTIONS] DEVICE [VOLUME...]"
 	device := app.StringArg("DEVICE", "", "")
-	volume := app.StringArg("VOLUME", "", "")
+	volumes := app.StringsArg("VOLUME", nil, "Volumes to export (default: all)")
 	app.Action = func() {
-		if err := startServer(url, device, volume); err != nil {
+		if err := startServer(url, device, volumes, preferredSize, maximumSize, ioEngine, metadataMode, cacheSize, vacuumInterval, metricsAddress); err != nil {
 			fmt.Printf("Error: %v\n", err)
 			os.Exit(1)
 		}
@@ -0,0 +1,116 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package main
+
+import (
+	"expvar"
+	"fmt"
+	"io"
+	"net/http"
+	_ "net/http/pprof"
+	"sort"
+
+	"github.com/Kampadais/dbs"
+)
+
+// Write a counter in the Prometheus text format, with one sample per label value.
+func writeCounter(w io.Writer, name string, help string, samples map[string]uint64) {
+	fmt.Fprintf(w, "# HELP %v %v\n# TYPE %v counter\n", name, help, name)
+	if v, ok := samples[""]; ok && len(samples) == 1 {
+		fmt.Fprintf(w, "%v %v\n", name, v)
+		return
+	}
+	for _, volumeName := range sortedKeys(samples) {
+		fmt.Fprintf(w, "%v{volume=%q} %v\n", name, volumeName, samples[volumeName])
+	}
+}
+
+// Write latency histograms in the Prometheus text format, in seconds and with cumulative buckets.
+func writeHistogram(w io.Writer, name string, help string, samples map[string]dbs.LatencyStats) {
+	fmt.Fprintf(w, "# HELP %v %v\n# TYPE %v histogram\n", name, help, name)
+	for _, volumeName := range sortedKeys(samples) {
+		s := samples[volumeName]
+		count := uint64(0)
+		for i, n := range s.Buckets {
+			count += n
+			le := "+Inf"
+			if bound := dbs.LatencyBucketBound(i); bound != 0 {
+				le = fmt.Sprint(bound.Seconds())
+			}
+			fmt.Fprintf(w, "%v_bucket{volume=%q,le=%q} %v\n", name, volumeName, le, count)
+		}
+		fmt.Fprintf(w, "%v_sum{volume=%q} %v\n", name, volumeName, s.Sum.Seconds())
+		fmt.Fprintf(w, "%v_count{volume=%q} %v\n", name, volumeName, count)
+	}
+}
+
+func sortedKeys[T any](m map[string]T) []string {
+	keys := make([]string, 0, len(m))
+	for k := range m {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	return keys
+}
+
+// Serve device and open volume statistics at /metrics, in the Prometheus text format.
+func metricsHandler(d *dbs.Device) http.HandlerFunc {
+	return func(w http.ResponseWriter, r *http.Request) {
+		ds := d.Stats()
+		vs := d.VolumeStats()
+		volumeCounter := func(get func(dbs.VolumeStats) uint64) map[string]uint64 {
+			samples := make(map[string]uint64, len(vs))
+			for volumeName, s := range vs {
+				samples[volumeName] = get(s)
+			}
+			return samples
+		}
+		volumeLatency := func(get func(dbs.VolumeStats) dbs.LatencyStats) map[string]dbs.LatencyStats {
+			samples := make(map[string]dbs.LatencyStats, len(vs))
+			for volumeName, s := range vs {
+				samples[volumeName] = get(s)
+			}
+			return samples
+		}
+		w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+		writeCounter(w, "dbs_allocated_extents_total", "Extents allocated on the device.", map[string]uint64{"": ds.AllocatedExtents})
+		writeCounter(w, "dbs_metadata_writes_total", "Metadata write I/Os.", map[string]uint64{"": ds.MetadataWrites})
+		writeCounter(w, "dbs_extent_flushes_total", "Batches of extent metadata updates written.", map[string]uint64{"": ds.ExtentFlushes})
+		writeCounter(w, "dbs_sync_requests_total", "Sync requests.", map[string]uint64{"": ds.SyncRequests})
+		writeCounter(w, "dbs_device_syncs_total", "Device flushes.", map[string]uint64{"": ds.DeviceSyncs})
+		writeCounter(w, "dbs_cache_hits_total", "Blocks read from the cache.", map[string]uint64{"": ds.CacheHits})
+		writeCounter(w, "dbs_cache_misses_total", "Blocks not found in the cache.", map[string]uint64{"": ds.CacheMisses})
+		writeCounter(w, "dbs_volume_reads_total", "Read requests.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.Reads }))
+		writeCounter(w, "dbs_volume_writes_total", "Write requests.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.Writes }))
+		writeCounter(w, "dbs_volume_unmaps_total", "Unmap and write zeroes requests.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.Unmaps }))
+		writeCounter(w, "dbs_volume_read_bytes_total", "Bytes read.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.ReadBytes }))
+		writeCounter(w, "dbs_volume_written_bytes_total", "Bytes written.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.WrittenBytes }))
+		writeCounter(w, "dbs_volume_hole_blocks_total", "Blocks read as zeros without I/O.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.HoleBlocks }))
+		writeCounter(w, "dbs_volume_copied_extents_total", "Extents copied from a previous snapshot.", volumeCounter(func(s dbs.VolumeStats) uint64 { return s.CopiedExtents }))
+		writeHistogram(w, "dbs_volume_read_latency_seconds", "Read request latency.", volumeLatency(func(s dbs.VolumeStats) dbs.LatencyStats { return s.ReadLatency }))
+		writeHistogram(w, "dbs_volume_write_latency_seconds", "Write request latency.", volumeLatency(func(s dbs.VolumeStats) dbs.LatencyStats { return s.WriteLatency }))
+	}
+}
+
+// Serve metrics at /metrics, the same as JSON at /debug/vars (expvar) and profiles at /debug/pprof.
+func serveMetrics(d *dbs.Device, address string) {
+	expvar.Publish("dbs", expvar.Func(func() any {
+		return map[string]any{"device": d.Stats(), "volumes": d.VolumeStats()}
+	}))
+	http.Handle("/metrics", metricsHandler(d))
+	if err := http.ListenAndServe(address, nil); err != nil {
+		fmt.Printf("Failed to serve metrics: %v\n", err)
+	}
+}
@@ -0,0 +1,104 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"encoding/binary"
+)
+
+// Fixed little-endian layouts of on-disk structures. Encoders and decoders work in place on (aligned) device
+// buffers, which must be large enough to hold the encoded structure.
+const (
+	SIZEOF_SUPERBLOCK        = 8 + 4 + 4 + 8 + 4 + 4 + 4
+	SIZEOF_VOLUME_METADATA   = 2 + 8 + MAX_VOLUME_NAME_SIZE + 1
+	SIZEOF_SNAPSHOT_METADATA = 2 + 8
+	SIZEOF_EXTENT_METADATA   = 2 + 4 + EXTENT_BITMAP_SIZE
+)
+
+var le = binary.LittleEndian
+
+func (sb *Superblock) encode(b []byte) {
+	_ = b[SIZEOF_SUPERBLOCK-1]
+	copy(b[0:8], sb.Magic[:])
+	le.PutUint32(b[8:], sb.Version)
+	le.PutUint32(b[12:], sb.AllocatedDeviceExtents)
+	le.PutUint64(b[16:], sb.DeviceSize)
+	le.PutUint32(b[24:], sb.BlockSize)
+	le.PutUint32(b[28:], sb.ExtentSize)
+	le.PutUint32(b[32:], sb.ClearedExtents)
+}
+
+func (sb *Superblock) decode(b []byte) {
+	_ = b[SIZEOF_SUPERBLOCK-1]
+	copy(sb.Magic[:], b[0:8])
+	sb.Version = le.Uint32(b[8:])
+	sb.AllocatedDeviceExtents = le.Uint32(b[12:])
+	sb.DeviceSize = le.Uint64(b[16:])
+	sb.BlockSize = le.Uint32(b[24:])
+	sb.ExtentSize = le.Uint32(b[28:])
+	sb.ClearedExtents = le.Uint32(b[32:])
+}
+
+func (v *VolumeMetadata) encode(b []byte) {
+	_ = b[SIZEOF_VOLUME_METADATA-1]
+	le.PutUint16(b[0:], v.SnapshotId)
+	le.PutUint64(b[2:], v.VolumeSize)
+	copy(b[10:SIZEOF_VOLUME_METADATA], v.VolumeName[:])
+}
+
+func (v *VolumeMetadata) decode(b []byte) {
+	_ = b[SIZEOF_VOLUME_METADATA-1]
+	v.SnapshotId = le.Uint16(b[0:])
+	v.VolumeSize = le.Uint64(b[2:])
+	copy(v.VolumeName[:], b[10:SIZEOF_VOLUME_METADATA])
+}
+
+func (s *SnapshotMetadata) encode(b []byte) {
+	_ = b[SIZEOF_SNAPSHOT_METADATA-1]
+	le.PutUint16(b[0:], s.ParentSnapshotId)
+	le.PutUint64(b[2:], uint64(s.CreatedAt))
+}
+
+func (s *SnapshotMetadata) decode(b []byte) {
+	_ = b[SIZEOF_SNAPSHOT_METADATA-1]
+	s.ParentSnapshotId = le.Uint16(b[0:])
+	s.CreatedAt = int64(le.Uint64(b[2:]))
+}
+
+func (e *ExtentMetadata) encode(b []byte) {
+	_ = b[SIZEOF_EXTENT_METADATA-1]
+	le.PutUint16(b[0:], e.SnapshotId)
+	le.PutUint32(b[2:], e.ExtentPos)
+	copy(b[6:SIZEOF_EXTENT_METADATA], e.BlockBitmap[:])
+}
+
+func (e *ExtentMetadata) decode(b []byte) {
+	_ = b[SIZEOF_EXTENT_METADATA-1]
+	e.SnapshotId = le.Uint16(b[0:])
+	e.ExtentPos = le.Uint32(b[2:])
+	copy(e.BlockBitmap[:], b[6:SIZEOF_EXTENT_METADATA])
+}
+
+func encodeExtents(b []byte, eb []ExtentMetadata) {
+	for i := range eb {
+		eb[i].encode(b[i*SIZEOF_EXTENT_METADATA:])
+	}
+}
+
+func decodeExtents(eb []ExtentMetadata, b []byte) {
+	for i := range eb {
+		eb[i].decode(b[i*SIZEOF_EXTENT_METADATA:])
+	}
+}
@@ -15,37 +15,84 @@
 package dbs
 
 import (
-	"bytes"
-	"encoding/binary"
 	"fmt"
+	"math/bits"
 	"os"
+	"sync"
 	"time"
 
+	"github.com/kelindar/bitmap"
 	"github.com/ncw/directio"
+	"golang.org/x/exp/slices"
 )
 
 const (
-	SIZEOF_EXTENT_METADATA = 6 + EXTENT_BITMAP_SIZE
+	DIRTY_EXTENTS = 4096 // Pending extent metadata updates before forcing a flush
 )
 
 func divRoundUp(x uint, y uint) uint {
 	return 1 + ((x - 1) / y)
 }
 
-// The device context holds the device file descriptor and all metadata except extents.
+// The device context holds the device file descriptor, all metadata except extents and the block cache, if any.
+//
+// Volume and snapshot tables are kept along with their on-disk image. Changes to table entries must go through
+// the context, which tracks the image blocks they touch, so that only those blocks are written back, and keeps
+// the table indexes up to date.
+// Extent allocation and extent metadata updates are safe for concurrent use.
+//
+// Single extent metadata updates and allocation count changes are kept in memory and written back
+// in batches on Flush (and on Sync or Close). The allocation count is written after extent metadata,
+// so after a crash any extents allocated but not yet recorded are simply lost (and reused).
 type DeviceContext struct {
 	f                  *DirectFile
 	superblock         *Superblock
 	volumes            [MAX_VOLUMES]VolumeMetadata
 	snapshots          [MAX_SNAPSHOTS]SnapshotMetadata
+	index              metadataIndex
+	metadata           []byte        // Image of the volume and snapshot tables, as stored after the superblock
+	dirtyMetadata      bitmap.Bitmap // Image blocks to be written
 	extentOffset       uint
 	totalDeviceExtents uint
 	dataOffset         uint
+	blockSize          uint // Geometry, from the superblock
+	extentSize         uint
+	blocksInExtent     uint
+	blockBitsInExtent  uint
+	allocLock          sync.Mutex // Protects the allocation count in the superblock and free extents
+	superblockDirty    bool
+	free               freeSet
+	freeOnce           sync.Once
+	freeErr            error
+	metadataLock       sync.Mutex // Protects extent metadata I/O and pending updates
+	dirtyExtents       map[uint]ExtentMetadata
+	cache              *BlockCache      // Optional, set before any I/O
+	mapping            *metadataMapping // Set in METADATA_MODE_MMAP
+	mappingLock        sync.Mutex       // Protects the dirty range of the mapping
+	syncLock           sync.Mutex       // Protects the group commit state
+	syncCond           *sync.Cond
+	syncing            bool
+	nextSync           *syncGroup // Callers waiting for a sync that has not started yet
+	metrics            deviceCounters
 }
 
-// Initialize a new, empty device context.
-func NewDeviceContext(device string) (*DeviceContext, error) {
-	f, err := NewDirectFile(device, os.O_RDWR, 0660)
+// Initialize a new, empty device context with the given geometry.
+func NewDeviceContext(device string, g Geometry) (*DeviceContext, error) {
+	g, err := g.normalize()
+	if err != nil {
+		return nil, err
+	}
+	dc, err := openDeviceContext(device)
+	if err != nil {
+		return nil, err
+	}
+	dc.setGeometry(g)
+	return dc, nil
+}
+
+// Open the device, before its layout is known.
+func openDeviceContext(device string) (*DeviceContext, error) {
+	f, err := NewDirectFile(device, os.O_RDWR, 0660, DefaultIOEngine)
 	if err != nil {
 		return nil, fmt.Errorf("cannot open %v: %w", device, err)
 	}
@@ -66,19 +113,41 @@ func NewDeviceContext(device string) (*DeviceContext, error) {
 			Version:    VERSION,
 			DeviceSize: uint64(deviceSize),
 		},
+		dirtyExtents: make(map[uint]ExtentMetadata),
 	}
+	dc.syncCond = sync.NewCond(&dc.syncLock)
 	copy(dc.superblock.Magic[:], []byte(MAGIC))
-	dc.extentOffset = (1 + divRoundUp(uint(binary.Size(dc.volumes)+binary.Size(dc.snapshots)), BLOCK_SIZE)) * BLOCK_SIZE
-	dc.totalDeviceExtents = uint((dc.superblock.DeviceSize - uint64(dc.extentOffset)) / EXTENT_SIZE)
+	return dc, nil
+}
+
+// Lay out the device for the given (normalized) geometry and set up the metadata image.
+func (dc *DeviceContext) setGeometry(g Geometry) {
+	dc.blockSize = g.BlockSize
+	dc.extentSize = g.ExtentSize
+	dc.blocksInExtent = g.ExtentSize / g.BlockSize
+	dc.blockBitsInExtent = uint(bits.TrailingZeros(dc.blocksInExtent))
+	dc.superblock.BlockSize = uint32(g.BlockSize)
+	dc.superblock.ExtentSize = uint32(g.ExtentSize)
+	if g != (Geometry{BlockSize: BLOCK_SIZE, ExtentSize: EXTENT_SIZE}) {
+		dc.superblock.Version = VERSION_GEOMETRY
+	}
+	dc.extentOffset = (1 + divRoundUp(MAX_VOLUMES*SIZEOF_VOLUME_METADATA+MAX_SNAPSHOTS*SIZEOF_SNAPSHOT_METADATA, BLOCK_SIZE)) * BLOCK_SIZE
+	dc.totalDeviceExtents = uint((dc.superblock.DeviceSize - uint64(dc.extentOffset)) / uint64(dc.extentSize))
 	metadataSize := dc.extentOffset + uint(dc.totalDeviceExtents*SIZEOF_EXTENT_METADATA)
-	dc.dataOffset = divRoundUp(metadataSize, EXTENT_SIZE) * EXTENT_SIZE
+	dc.dataOffset = divRoundUp(metadataSize, dc.extentSize) * dc.extentSize
 	// Account for storage of extent metadata
-	dc.totalDeviceExtents -= (dc.totalDeviceExtents * SIZEOF_EXTENT_METADATA) / EXTENT_SIZE
-	return dc, nil
+	dc.totalDeviceExtents -= (dc.totalDeviceExtents * SIZEOF_EXTENT_METADATA) / dc.extentSize
+	// With large extents, the metadata area may take up more than that
+	dc.totalDeviceExtents = min(dc.totalDeviceExtents, uint((dc.superblock.DeviceSize-uint64(dc.dataOffset))/uint64(dc.extentSize)))
+	dc.mapMetadata(DefaultMetadataMode)
+	// Nothing is written yet
+	dc.metadata = directio.AlignedBlock(int(dc.extentOffset - BLOCK_SIZE))
+	dc.markMetadata(0, uint(len(dc.metadata)))
+	dc.indexMetadata()
 }
 
 func GetDeviceContext(device string) (*DeviceContext, error) {
-	dc, err := NewDeviceContext(device)
+	dc, err := openDeviceContext(device)
 	if err != nil {
 		return nil, err
 	}
@@ -93,133 +162,396 @@ func GetDeviceContext(device string) (*DeviceContext, error) {
 
 func (dc *DeviceContext) ReadSuperblock() error {
 	var sb Superblock
-	abuf := directio.AlignedBlock(BLOCK_SIZE)
-	if _, err := dc.f.ReadAt(abuf, 0); err != nil {
+	buf := getBuffer(BLOCK_SIZE)
+	defer buf.release()
+	abuf := buf.b
+	if _, err := dc.readMetadataAt(abuf, 0); err != nil {
 		return fmt.Errorf("failed to read superblock: %w", err)
 	}
-	buf := bytes.NewBuffer(abuf)
-	if err := binary.Read(buf, binary.LittleEndian, &sb); err != nil {
-		return fmt.Errorf("failed to deserialize superblock: %w", err)
-	}
+	sb.decode(abuf)
 	if dc.superblock.Magic != sb.Magic {
 		return fmt.Errorf("device not initialized")
 	}
-	if dc.superblock.Version != sb.Version {
+	if sb.Version != VERSION && sb.Version != VERSION_GEOMETRY {
 		return fmt.Errorf("version mismatch in superblock")
 	}
 	if dc.superblock.DeviceSize != sb.DeviceSize {
 		return fmt.Errorf("device size mismatch in superblock")
 	}
+	g, err := Geometry{BlockSize: uint(sb.BlockSize), ExtentSize: uint(sb.ExtentSize)}.normalize()
+	if err != nil {
+		return fmt.Errorf("invalid geometry in superblock: %w", err)
+	}
 	dc.superblock = &sb
+	if dc.metadata == nil {
+		dc.setGeometry(g)
+	}
 	return nil
 }
 
 func (dc *DeviceContext) ReadMetadata() error {
-	abuf := directio.AlignedBlock(int(dc.extentOffset - BLOCK_SIZE))
-	if _, err := dc.f.ReadAt(abuf, BLOCK_SIZE); err != nil {
+	if _, err := dc.readMetadataAt(dc.metadata, BLOCK_SIZE); err != nil {
 		return fmt.Errorf("failed to read metadata: %w", err)
 	}
-	buf := bytes.NewBuffer(abuf)
-	if err := binary.Read(buf, binary.LittleEndian, dc.volumes[:]); err != nil {
-		return fmt.Errorf("failed to deserialize volume metadata: %w", err)
+	for i := range dc.volumes {
+		dc.volumes[i].decode(dc.metadata[i*SIZEOF_VOLUME_METADATA:])
 	}
-	if err := binary.Read(buf, binary.LittleEndian, dc.snapshots[:]); err != nil {
-		return fmt.Errorf("failed to deserialize snapshot metadata: %w", err)
+	sbuf := dc.metadata[MAX_VOLUMES*SIZEOF_VOLUME_METADATA:]
+	for i := range dc.snapshots {
+		dc.snapshots[i].decode(sbuf[i*SIZEOF_SNAPSHOT_METADATA:])
 	}
+	dc.dirtyMetadata.Clear()
+	dc.indexMetadata()
 	return nil
 }
 
+// Read extent metadata from the device, including any pending updates.
 func (dc *DeviceContext) ReadExtents(eb []ExtentMetadata, eidx uint) error {
+	dc.metadataLock.Lock()
+	defer dc.metadataLock.Unlock()
 	offset := uint64(dc.extentOffset + (eidx * SIZEOF_EXTENT_METADATA))
-	size := uint64(binary.Size(eb))
+	size := uint64(len(eb) * SIZEOF_EXTENT_METADATA)
 	blocks := ((offset + size) / BLOCK_SIZE) - (offset / BLOCK_SIZE) + 1
-	abuf := directio.AlignedBlock(int(BLOCK_SIZE * blocks))
-	if _, err := dc.f.ReadAt(abuf, (offset/BLOCK_SIZE)*BLOCK_SIZE); err != nil {
+	buf := getBuffer(int(BLOCK_SIZE * blocks))
+	defer buf.release()
+	abuf := buf.b
+	if _, err := dc.readMetadataAt(abuf, (offset/BLOCK_SIZE)*BLOCK_SIZE); err != nil {
 		return fmt.Errorf("failed to read extent metadata: %w", err)
 	}
-	buf := bytes.NewBuffer(abuf[offset%BLOCK_SIZE : (offset%BLOCK_SIZE)+size])
-	if err := binary.Read(buf, binary.LittleEndian, eb); err != nil {
-		return fmt.Errorf("failed to deserialize extent metadata: %w", err)
+	decodeExtents(eb, abuf[offset%BLOCK_SIZE:])
+	for i, e := range dc.dirtyExtents {
+		if i >= eidx && i < eidx+uint(len(eb)) {
+			eb[i-eidx] = e
+		}
 	}
 	return nil
 }
 
 func (dc *DeviceContext) ReadBlockData(data []byte, epos uint, bidx uint) error {
-	offset := uint64(dc.dataOffset + (epos * EXTENT_SIZE) + (bidx * BLOCK_SIZE))
-	if _, err := dc.f.ReadAt(data[0:BLOCK_SIZE], offset); err != nil {
+	return dc.ReadBlocksData(data[0:dc.blockSize], epos, bidx)
+}
+
+// Get the device offset of a block.
+func (dc *DeviceContext) blockDataOffset(epos uint, bidx uint) uint64 {
+	return uint64(dc.dataOffset) + uint64(epos)*uint64(dc.extentSize) + uint64(bidx*dc.blockSize)
+}
+
+// Get the index of the extent holding a volume block and the index of the block in it.
+func (dc *DeviceContext) blockPosition(block uint64) (uint, uint) {
+	return uint(block >> dc.blockBitsInExtent), uint(block) & (dc.blocksInExtent - 1)
+}
+
+// Get the number of blocks from a volume block to the end of its extent.
+func (dc *DeviceContext) blocksLeftInExtent(block uint64) uint64 {
+	return uint64(dc.blocksInExtent) - block&uint64(dc.blocksInExtent-1)
+}
+
+// Get the position of a block in the data area, which identifies it in the block cache.
+func (dc *DeviceContext) dataBlock(epos uint, bidx uint) uint64 {
+	return uint64(epos)<<dc.blockBitsInExtent + uint64(bidx)
+}
+
+// Drop cached copies of data being written at the given device offset.
+func (dc *DeviceContext) invalidateData(offset uint64, length int) {
+	dc.cache.invalidate((offset-uint64(dc.dataOffset))/uint64(dc.blockSize), uint64(uint(length)/dc.blockSize))
+}
+
+// Read consecutive blocks of an extent with a single I/O. The data length must be a multiple of the block size.
+func (dc *DeviceContext) ReadBlocksData(data []byte, epos uint, bidx uint) error {
+	offset := dc.blockDataOffset(epos, bidx)
+	if _, err := dc.f.ReadAt(data, offset); err != nil {
 		return fmt.Errorf("failed to read block: %w", err)
 	}
 	return nil
 }
 
-func (dc *DeviceContext) WriteSuperblock() error {
-	buf := new(bytes.Buffer)
-	if err := binary.Write(buf, binary.LittleEndian, dc.superblock); err != nil {
-		return fmt.Errorf("failed to serialize superblock: %w", err)
+// Run block data requests concurrently. Request offsets must come from blockDataOffset.
+func (dc *DeviceContext) SubmitBlocksData(reqs ...*IORequest) error {
+	switch {
+	case len(reqs) == 0:
+		return nil
+	case len(reqs) == 1:
+		// Avoid the request setup for the common case
+		var err error
+		if reqs[0].Write {
+			dc.invalidateData(reqs[0].Offset, len(reqs[0].Data))
+			_, err = dc.f.WriteAt(reqs[0].Data, reqs[0].Offset)
+		} else {
+			_, err = dc.f.ReadAt(reqs[0].Data, reqs[0].Offset)
+		}
+		if err != nil {
+			return fmt.Errorf("failed to access block: %w", err)
+		}
+		return nil
+	}
+	for _, req := range reqs {
+		if req.Write {
+			dc.invalidateData(req.Offset, len(req.Data))
+		}
+	}
+	if err := dc.f.SubmitAndWait(reqs...); err != nil {
+		return fmt.Errorf("failed to access block: %w", err)
 	}
-	abuf := directio.AlignedBlock(BLOCK_SIZE)
-	copy(abuf[0:], buf.Bytes())
-	if _, err := dc.f.WriteAt(abuf, 0); err != nil {
+	return nil
+}
+
+func (dc *DeviceContext) WriteSuperblock() error {
+	dc.allocLock.Lock()
+	defer dc.allocLock.Unlock()
+	dc.superblockDirty = false
+	buf := getBuffer(BLOCK_SIZE)
+	defer buf.release()
+	abuf := buf.b
+	clear(abuf)
+	dc.superblock.encode(abuf)
+	dc.metrics.metadataWrites.Add(1)
+	if _, err := dc.writeMetadataAt(abuf, 0); err != nil {
+		dc.superblockDirty = true
 		return fmt.Errorf("failed to write superblock: %w", err)
 	}
 	return nil
 }
 
+// Write the dirty blocks of the volume and snapshot tables, coalescing adjacent blocks into single writes.
 func (dc *DeviceContext) WriteMetadata() error {
-	buf := new(bytes.Buffer)
-	if err := binary.Write(buf, binary.LittleEndian, dc.volumes); err != nil {
-		return fmt.Errorf("failed to serialize volume metadata: %w", err)
+	blocks := uint32(len(dc.metadata) / BLOCK_SIZE)
+	for first := uint32(0); first < blocks; first++ {
+		if !dc.dirtyMetadata.Contains(first) {
+			continue
+		}
+		last := first
+		for last+1 < blocks && dc.dirtyMetadata.Contains(last+1) {
+			last++
+		}
+		start, end := uint(first)*BLOCK_SIZE, uint(last+1)*BLOCK_SIZE
+		dc.encodeMetadata(start, end)
+		dc.metrics.metadataWrites.Add(1)
+		if _, err := dc.writeMetadataAt(dc.metadata[start:end], uint64(BLOCK_SIZE+start)); err != nil {
+			return fmt.Errorf("failed to write metadata: %w", err)
+		}
+		for b := first; b <= last; b++ {
+			dc.dirtyMetadata.Remove(b)
+		}
+		first = last
 	}
-	if err := binary.Write(buf, binary.LittleEndian, dc.snapshots); err != nil {
-		return fmt.Errorf("failed to serialize snapshot metadata: %w", err)
+	return nil
+}
+
+// Encode all table entries overlapping the given byte range of the image.
+func (dc *DeviceContext) encodeMetadata(start uint, end uint) {
+	vend := uint(MAX_VOLUMES * SIZEOF_VOLUME_METADATA)
+	if start < vend {
+		for i := start / SIZEOF_VOLUME_METADATA; i < min(divRoundUp(end, SIZEOF_VOLUME_METADATA), MAX_VOLUMES); i++ {
+			dc.volumes[i].encode(dc.metadata[i*SIZEOF_VOLUME_METADATA:])
+		}
 	}
-	abuf := directio.AlignedBlock(int(dc.extentOffset - BLOCK_SIZE))
-	copy(abuf[0:], buf.Bytes())
-	if _, err := dc.f.WriteAt(abuf, BLOCK_SIZE); err != nil {
-		return fmt.Errorf("failed to write metadata: %w", err)
+	if end > vend {
+		sbuf := dc.metadata[vend:]
+		sstart, send := max(start, vend)-vend, end-vend
+		for i := sstart / SIZEOF_SNAPSHOT_METADATA; i < min(divRoundUp(send, SIZEOF_SNAPSHOT_METADATA), MAX_SNAPSHOTS); i++ {
+			dc.snapshots[i].encode(sbuf[i*SIZEOF_SNAPSHOT_METADATA:])
+		}
 	}
-	return nil
 }
 
+// Mark the image blocks holding the given byte range as dirty.
+func (dc *DeviceContext) markMetadata(offset uint, size uint) {
+	for b := offset / BLOCK_SIZE; b <= (offset+size-1)/BLOCK_SIZE; b++ {
+		dc.dirtyMetadata.Set(uint32(b))
+	}
+}
+
+func (dc *DeviceContext) markVolume(vidx uint) {
+	dc.markMetadata(vidx*SIZEOF_VOLUME_METADATA, SIZEOF_VOLUME_METADATA)
+}
+
+func (dc *DeviceContext) markSnapshot(snapshotId uint16) {
+	dc.markMetadata(MAX_VOLUMES*SIZEOF_VOLUME_METADATA+(uint(snapshotId)-1)*SIZEOF_SNAPSHOT_METADATA, SIZEOF_SNAPSHOT_METADATA)
+}
+
+// Get the index of the given volume in the volume table.
+func (dc *DeviceContext) volumeIndex(v *VolumeMetadata) uint {
+	if v.SnapshotId != 0 {
+		if vidx := uint(dc.index.heads[v.SnapshotId-1]); vidx != 0 && &dc.volumes[vidx-1] == v {
+			return vidx - 1
+		}
+	}
+	panic("volume metadata not in device context")
+}
+
+// Write extent metadata to the device, replacing any pending updates.
 func (dc *DeviceContext) WriteExtents(eb []ExtentMetadata, eidx uint) error {
-	buf := new(bytes.Buffer)
-	if err := binary.Write(buf, binary.LittleEndian, eb); err != nil {
-		return fmt.Errorf("failed to serialize extent metadata: %w", err)
+	dc.metadataLock.Lock()
+	defer dc.metadataLock.Unlock()
+	for i := range dc.dirtyExtents {
+		if i >= eidx && i < eidx+uint(len(eb)) {
+			delete(dc.dirtyExtents, i)
+		}
 	}
 	offset := uint64(dc.extentOffset + (eidx * SIZEOF_EXTENT_METADATA))
-	size := uint64(binary.Size(eb))
+	size := uint64(len(eb) * SIZEOF_EXTENT_METADATA)
 	blocks := ((offset + size) / BLOCK_SIZE) - (offset / BLOCK_SIZE) + 1
-	abuf := directio.AlignedBlock(int(BLOCK_SIZE * blocks))
-	if _, err := dc.f.ReadAt(abuf, (offset/BLOCK_SIZE)*BLOCK_SIZE); err != nil {
+	buf := getBuffer(int(BLOCK_SIZE * blocks))
+	defer buf.release()
+	abuf := buf.b
+	if _, err := dc.readMetadataAt(abuf, (offset/BLOCK_SIZE)*BLOCK_SIZE); err != nil {
 		return fmt.Errorf("failed to read extent metadata: %w", err)
 	}
-	copy(abuf[offset%BLOCK_SIZE:(offset%BLOCK_SIZE)+size], buf.Bytes())
-	if _, err := dc.f.WriteAt(abuf, (offset/BLOCK_SIZE)*BLOCK_SIZE); err != nil {
+	encodeExtents(abuf[offset%BLOCK_SIZE:], eb)
+	dc.metrics.metadataWrites.Add(1)
+	if _, err := dc.writeMetadataAt(abuf, (offset/BLOCK_SIZE)*BLOCK_SIZE); err != nil {
 		return fmt.Errorf("failed to write extent metadata: %w", err)
 	}
 	return nil
 }
 
+// Queue an extent metadata update. The update is written to the device on the next flush.
 func (dc *DeviceContext) WriteExtent(e *ExtentMetadata, eidx uint) error {
-	return dc.WriteExtents([]ExtentMetadata{*e}, eidx)
+	dc.metadataLock.Lock()
+	defer dc.metadataLock.Unlock()
+	dc.dirtyExtents[eidx] = *e
+	if len(dc.dirtyExtents) < DIRTY_EXTENTS {
+		return nil
+	}
+	return dc.flushExtents()
+}
+
+// Get the first and last device block holding the metadata of an extent.
+func (dc *DeviceContext) extentMetadataBlocks(eidx uint) (uint, uint) {
+	offset := dc.extentOffset + (eidx * SIZEOF_EXTENT_METADATA)
+	return offset / BLOCK_SIZE, (offset + SIZEOF_EXTENT_METADATA - 1) / BLOCK_SIZE
+}
+
+// Write all pending extent metadata updates. Updates in the same or adjacent metadata blocks are
+// coalesced into a single read-modify-write cycle, and all cycles are issued concurrently.
+// Must be called with the metadata lock held.
+func (dc *DeviceContext) flushExtents() error {
+	if len(dc.dirtyExtents) == 0 {
+		return nil
+	}
+	eidxs := make([]uint, 0, len(dc.dirtyExtents))
+	for eidx := range dc.dirtyExtents {
+		eidxs = append(eidxs, eidx)
+	}
+	slices.Sort(eidxs)
+	maxBlocks := uint(EXTENT_BATCH*SIZEOF_EXTENT_METADATA) / BLOCK_SIZE
+	type group struct {
+		start, end int
+		req        *IORequest
+	}
+	var groups []group
+	for start := 0; start < len(eidxs); {
+		first, last := dc.extentMetadataBlocks(eidxs[start])
+		end := start + 1
+		for ; end < len(eidxs); end++ {
+			efirst, elast := dc.extentMetadataBlocks(eidxs[end])
+			// Groups must not share blocks, as they are updated concurrently
+			if efirst > last+1 || (efirst > last && elast-first >= maxBlocks) {
+				break
+			}
+			last = elast
+		}
+		buf := getBuffer(int((last - first + 1) * BLOCK_SIZE))
+		defer buf.release()
+		groups = append(groups, group{start, end, &IORequest{
+			Data:   buf.b,
+			Offset: uint64(first * BLOCK_SIZE),
+		}})
+		start = end
+	}
+	// Read all affected blocks at once, update them and write them back at once
+	reqs := make([]*IORequest, len(groups))
+	for i := range groups {
+		reqs[i] = groups[i].req
+	}
+	if err := dc.submitMetadata(reqs...); err != nil {
+		return fmt.Errorf("failed to read extent metadata: %w", err)
+	}
+	for _, g := range groups {
+		for _, eidx := range eidxs[g.start:g.end] {
+			e := dc.dirtyExtents[eidx]
+			e.encode(g.req.Data[uint64(dc.extentOffset+(eidx*SIZEOF_EXTENT_METADATA))-g.req.Offset:])
+		}
+		g.req.Write = true
+	}
+	dc.metrics.extentFlushes.Add(1)
+	dc.metrics.metadataWrites.Add(uint64(len(reqs)))
+	if err := dc.submitMetadata(reqs...); err != nil {
+		return fmt.Errorf("failed to write extent metadata: %w", err)
+	}
+	// Released extents can be reused now that their release is on the device
+	dc.releaseExtents(eidxs)
+	clear(dc.dirtyExtents)
+	return nil
+}
+
+// Write all pending metadata updates to the device.
+func (dc *DeviceContext) Flush() error {
+	dc.metadataLock.Lock()
+	err := dc.flushExtents()
+	dc.metadataLock.Unlock()
+	if err != nil {
+		return err
+	}
+	// Mapped extent metadata must be on the device before the allocation count and the tables
+	if err := dc.syncMetadata(); err != nil {
+		return err
+	}
+	dc.allocLock.Lock()
+	superblockDirty := dc.superblockDirty
+	dc.allocLock.Unlock()
+	if superblockDirty {
+		return dc.WriteSuperblock()
+	}
+	return nil
 }
 
 func (dc *DeviceContext) WriteBlockData(data []byte, epos uint, bidx uint) error {
-	offset := uint64(dc.dataOffset + (epos * EXTENT_SIZE) + (bidx * BLOCK_SIZE))
-	if _, err := dc.f.WriteAt(data[0:BLOCK_SIZE], offset); err != nil {
+	return dc.WriteBlocksData(data[0:dc.blockSize], epos, bidx)
+}
+
+// Write consecutive blocks of an extent with a single I/O. The data length must be a multiple of the block size.
+func (dc *DeviceContext) WriteBlocksData(data []byte, epos uint, bidx uint) error {
+	offset := dc.blockDataOffset(epos, bidx)
+	dc.invalidateData(offset, len(data))
+	if _, err := dc.f.WriteAt(data, offset); err != nil {
 		return fmt.Errorf("failed to write block: %w", err)
 	}
 	return nil
 }
 
-func (dc *DeviceContext) CopyExtentData(esrc uint, edst uint) error {
-	abuf := directio.AlignedBlock(EXTENT_SIZE)
-	if _, err := dc.f.ReadAt(abuf, uint64(dc.dataOffset+(esrc*EXTENT_SIZE))); err != nil {
-		return fmt.Errorf("failed to read extent data: %w", err)
+// Copy the blocks of an extent that are set in the given bitmap to another extent. Each run of consecutive
+// blocks is copied with a single I/O and all runs are issued concurrently.
+func (dc *DeviceContext) CopyExtentData(esrc uint, edst uint, blocks bitmap.Bitmap) error {
+	buf := getBuffer(int(dc.extentSize))
+	defer buf.release()
+	var reqs []*IORequest
+	for i := uint(0); i < dc.blocksInExtent; {
+		if !blocks.Contains(uint32(i)) {
+			i++
+			continue
+		}
+		j := i + 1
+		for j < dc.blocksInExtent && blocks.Contains(uint32(j)) {
+			j++
+		}
+		reqs = append(reqs, &IORequest{Data: buf.b[i*dc.blockSize : j*dc.blockSize], Offset: dc.blockDataOffset(esrc, i)})
+		i = j
 	}
-	if _, err := dc.f.WriteAt(abuf, uint64(dc.dataOffset+(edst*EXTENT_SIZE))); err != nil {
+	if len(reqs) == 0 {
+		return nil
+	}
+	if err := dc.f.SubmitAndWait(reqs...); err != nil {
 		return fmt.Errorf("failed to read extent data: %w", err)
 	}
+	for _, req := range reqs {
+		req.Offset = dc.blockDataOffset(edst, 0) + (req.Offset - dc.blockDataOffset(esrc, 0))
+		req.Write = true
+		dc.invalidateData(req.Offset, len(req.Data))
+	}
+	if err := dc.f.SubmitAndWait(reqs...); err != nil {
+		return fmt.Errorf("failed to write extent data: %w", err)
+	}
 	return nil
 }
 
@@ -227,51 +559,50 @@ func (dc *DeviceContext) CopyExtentData(esrc uint, edst uint) error {
 func (dc *DeviceContext) FindVolume(volumeName string) *VolumeMetadata {
 	var vname [MAX_VOLUME_NAME_SIZE + 1]byte
 	copy(vname[:], volumeName)
-	for i := 0; i < MAX_VOLUMES; i++ {
-		if dc.volumes[i].SnapshotId == 0 {
-			continue
-		}
-		if dc.volumes[i].VolumeName == vname {
-			return &dc.volumes[i]
-		}
+	if vidx, ok := dc.index.names[vname]; ok {
+		return &dc.volumes[vidx]
 	}
 	return nil
 }
 
-// Find the descendant of the snapshot with the given identifier. Returns 0 if not found.
+// Find the descendant of the snapshot with the given identifier (the lowest one, if shared by linked clones).
+// Returns 0 if not found.
 func (dc *DeviceContext) FindChildSnapshot(snapshotId uint16) uint16 {
-	for i := 0; i < MAX_SNAPSHOTS; i++ {
-		if dc.snapshots[i].CreatedAt == 0 {
-			continue
-		}
-		if dc.snapshots[i].ParentSnapshotId == snapshotId {
-			return uint16(i + 1)
+	return dc.index.firstChild[snapshotId-1]
+}
+
+// Count the snapshots having the given snapshot as parent. More than one means the snapshot is shared by
+// linked clones.
+func (dc *DeviceContext) CountChildSnapshots(snapshotId uint16) uint {
+	count := uint(0)
+	for sid := dc.index.firstChild[snapshotId-1]; sid > 0; sid = dc.index.nextSibling[sid-1] {
+		count++
+	}
+	return count
+}
+
+// Check whether a snapshot is in the chain of a volume.
+func (dc *DeviceContext) HasSnapshot(v *VolumeMetadata, snapshotId uint16) bool {
+	for sid := v.SnapshotId; sid > 0; sid = dc.snapshots[sid-1].ParentSnapshotId {
+		if sid == snapshotId {
+			return true
 		}
 	}
-	return 0
+	return false
 }
 
 // Find the volume metadata for the given snapshot identifier. Returns 0 if not found.
 func (dc *DeviceContext) FindVolumeWithSnapshot(snapshotId uint16) *VolumeMetadata {
 	for sid := snapshotId; sid > 0; sid = dc.FindChildSnapshot(sid) {
-		for i := 0; i < MAX_VOLUMES; i++ {
-			if dc.volumes[i].SnapshotId == sid {
-				return &dc.volumes[i]
-			}
+		if vidx := dc.index.heads[sid-1]; vidx != 0 {
+			return &dc.volumes[vidx-1]
 		}
 	}
 	return nil
 }
 
 func (dc *DeviceContext) CountVolumes() uint {
-	count := uint(0)
-	for i := 0; i < MAX_VOLUMES; i++ {
-		if dc.volumes[i].SnapshotId == 0 {
-			continue
-		}
-		count++
-	}
-	return count
+	return MAX_VOLUMES - dc.index.freeVolumes.count
 }
 
 func (dc *DeviceContext) CountSnapshots(v *VolumeMetadata) uint {
@@ -284,10 +615,7 @@ func (dc *DeviceContext) CountSnapshots(v *VolumeMetadata) uint {
 
 // Add a new volume (and corresponding snapshot). Return a pointer to the volume metadata.
 func (dc *DeviceContext) AddVolume(volumeName string, volumeSize uint64) (*VolumeMetadata, error) {
-	var vidx uint
-	for vidx = 0; vidx < MAX_VOLUMES && dc.volumes[vidx].SnapshotId != 0; vidx++ {
-	}
-	if vidx == MAX_VOLUMES {
+	if _, ok := dc.index.freeVolumes.next(0, MAX_VOLUMES); !ok {
 		return nil, fmt.Errorf("max volume count reached")
 	}
 
@@ -295,31 +623,142 @@ func (dc *DeviceContext) AddVolume(volumeName string, volumeSize uint64) (*Volum
 	if err != nil {
 		return nil, err
 	}
-	dc.volumes[vidx].SnapshotId = uint16(sid)
-	dc.volumes[vidx].VolumeSize = (volumeSize / EXTENT_SIZE) * EXTENT_SIZE
-	dc.volumes[vidx].setName(volumeName)
-	return &dc.volumes[vidx], nil
+	return dc.AttachVolume(volumeName, volumeSize, sid)
+}
+
+// Add a new volume with an existing snapshot, not used by any other volume, as its current snapshot.
+func (dc *DeviceContext) AttachVolume(volumeName string, volumeSize uint64, snapshotId uint16) (*VolumeMetadata, error) {
+	vidx, ok := dc.index.freeVolumes.next(0, MAX_VOLUMES)
+	if !ok {
+		return nil, fmt.Errorf("max volume count reached")
+	}
+	dc.index.freeVolumes.remove(vidx)
+	v := &dc.volumes[vidx]
+	v.SnapshotId = snapshotId
+	v.VolumeSize = (volumeSize / uint64(dc.extentSize)) * uint64(dc.extentSize)
+	v.setName(volumeName)
+	dc.index.names[v.VolumeName] = uint16(vidx)
+	dc.index.heads[snapshotId-1] = uint16(vidx) + 1
+	dc.markVolume(uint(vidx))
+	return v, nil
+}
+
+func (dc *DeviceContext) SetVolumeName(v *VolumeMetadata, volumeName string) {
+	vidx := dc.volumeIndex(v)
+	delete(dc.index.names, v.VolumeName)
+	v.setName(volumeName)
+	dc.index.names[v.VolumeName] = uint16(vidx)
+	dc.markVolume(vidx)
+}
+
+func (dc *DeviceContext) SetVolumeSnapshot(v *VolumeMetadata, snapshotId uint16) {
+	vidx := dc.volumeIndex(v)
+	dc.index.heads[v.SnapshotId-1] = 0
+	v.SnapshotId = snapshotId
+	dc.index.heads[snapshotId-1] = uint16(vidx) + 1
+	dc.markVolume(vidx)
+}
+
+// Remove a volume. Its snapshots must be removed separately.
+func (dc *DeviceContext) RemoveVolume(v *VolumeMetadata) {
+	vidx := dc.volumeIndex(v)
+	delete(dc.index.names, v.VolumeName)
+	dc.index.heads[v.SnapshotId-1] = 0
+	dc.index.freeVolumes.add(uint32(vidx))
+	*v = VolumeMetadata{}
+	dc.markVolume(vidx)
 }
 
 // Add a new snapshot. Return the snapshot identifier.
 func (dc *DeviceContext) AddSnapshot(parentSnapshotId uint16) (uint16, error) {
-	var sidx uint
-	for sidx = 0; sidx < MAX_SNAPSHOTS && dc.snapshots[sidx].CreatedAt != 0; sidx++ {
-	}
-	if sidx == MAX_SNAPSHOTS {
+	sidx, ok := dc.index.freeSnapshots.next(0, MAX_SNAPSHOTS)
+	if !ok {
 		return 0, fmt.Errorf("max snapshot count reached")
 	}
 
+	dc.index.freeSnapshots.remove(sidx)
 	dc.snapshots[sidx].ParentSnapshotId = parentSnapshotId
 	dc.snapshots[sidx].CreatedAt = time.Now().Unix()
+	dc.index.linkSnapshot(uint16(sidx)+1, parentSnapshotId)
+	dc.markSnapshot(uint16(sidx) + 1)
 	return uint16(sidx) + 1, nil
 }
 
-// Close the device file descriptor.
-func (dc *DeviceContext) Close() error {
+func (dc *DeviceContext) SetSnapshotParent(snapshotId uint16, parentSnapshotId uint16) {
+	dc.index.unlinkSnapshot(snapshotId, dc.snapshots[snapshotId-1].ParentSnapshotId)
+	dc.snapshots[snapshotId-1].ParentSnapshotId = parentSnapshotId
+	dc.index.linkSnapshot(snapshotId, parentSnapshotId)
+	dc.markSnapshot(snapshotId)
+}
+
+func (dc *DeviceContext) SetSnapshotCreatedAt(snapshotId uint16, createdAt int64) {
+	dc.snapshots[snapshotId-1].CreatedAt = createdAt
+	dc.markSnapshot(snapshotId)
+}
+
+// Remove a snapshot. Its extents must be cleared separately.
+func (dc *DeviceContext) RemoveSnapshot(snapshotId uint16) {
+	dc.index.unlinkSnapshot(snapshotId, dc.snapshots[snapshotId-1].ParentSnapshotId)
+	dc.index.freeSnapshots.add(uint32(snapshotId - 1))
+	dc.snapshots[snapshotId-1] = SnapshotMetadata{}
+	dc.markSnapshot(snapshotId)
+}
+
+// Callers served by the same device sync, which all get its result.
+type syncGroup struct {
+	done bool
+	err  error
+}
+
+// Write all pending metadata updates and flush the device. Concurrent calls are grouped: callers arriving while
+// a sync is running wait for it to finish and then share a single new one, which covers all of their writes.
+func (dc *DeviceContext) Sync() error {
+	dc.metrics.syncRequests.Add(1)
+	dc.syncLock.Lock()
+	defer dc.syncLock.Unlock()
+	// Only a sync starting after the call covers all writes completed before it
+	if dc.nextSync == nil {
+		dc.nextSync = &syncGroup{}
+	}
+	g := dc.nextSync
+	for !g.done {
+		if dc.syncing {
+			dc.syncCond.Wait()
+			continue
+		}
+		// The group has not started yet, so it is the next one
+		dc.syncing = true
+		dc.nextSync = nil
+		dc.syncLock.Unlock()
+		err := dc.syncDevice()
+		dc.syncLock.Lock()
+		dc.syncing = false
+		g.done, g.err = true, err
+		dc.syncCond.Broadcast()
+	}
+	return g.err
+}
+
+func (dc *DeviceContext) syncDevice() error {
+	dc.metrics.deviceSyncs.Add(1)
+	if err := dc.Flush(); err != nil {
+		return err
+	}
+	if err := dc.syncMetadata(); err != nil {
+		return err
+	}
 	if err := dc.f.Sync(); err != nil {
 		return fmt.Errorf("cannot sync device: %w", err)
 	}
+	return nil
+}
+
+// Close the device file descriptor.
+func (dc *DeviceContext) Close() error {
+	if err := dc.Sync(); err != nil {
+		return err
+	}
+	dc.unmapMetadata()
 	dc.f.Close()
 	return nil
 }
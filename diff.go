@@ -0,0 +1,140 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+
+	"github.com/kelindar/bitmap"
+)
+
+// A run of volume blocks (of the device block size) that differ between two snapshots. Zero runs have been
+// unmapped and read as zeros; the rest hold data.
+type BlockRange struct {
+	Block uint64
+	Count uint64
+	Zero  bool
+}
+
+// Report the blocks of a snapshot that differ from one of its ancestors (or, with a zero base, all blocks
+// holding data), as runs in block order. The difference comes from a single scan of extent metadata. Blocks are
+// tracked per extent copy, so blocks carried over by copy-on-write are reported even if not overwritten. If the
+// snapshot is the current snapshot of an open volume, concurrent writes may or may not be included.
+func (d *Device) DiffSnapshots(snapshotId uint, baseSnapshotId uint, fn func(r BlockRange) error) error {
+	d.lock.RLock()
+	defer d.lock.RUnlock()
+	_, newMap, oldMap, err := getDiffExtentMaps(d.dc, snapshotId, baseSnapshotId)
+	if err != nil {
+		return err
+	}
+
+	// Coalesce runs across extents
+	var run BlockRange
+	emit := func(block uint64, zero bool) error {
+		if run.Count > 0 && run.Block+run.Count == block && run.Zero == zero {
+			run.Count++
+			return nil
+		}
+		if run.Count > 0 {
+			if err := fn(run); err != nil {
+				return err
+			}
+		}
+		run = BlockRange{Block: block, Count: 1, Zero: zero}
+		return nil
+	}
+	err = newMap.forEach(func(eidx uint32, e *ExtentMetadata) error {
+		nb := bitmap.FromBytes(e.BlockBitmap[:])
+		var ob bitmap.Bitmap
+		if o := oldMap.lookup(eidx); o != nil && o.SnapshotId != 0 {
+			ob = bitmap.FromBytes(o.BlockBitmap[:])
+		}
+		first := uint64(eidx) << d.dc.blockBitsInExtent
+		for bidx := uint32(0); bidx < uint32(d.dc.blocksInExtent); bidx++ {
+			if nb.Contains(bidx) {
+				if err := emit(first+uint64(bidx), false); err != nil {
+					return err
+				}
+			} else if ob.Contains(bidx) {
+				if err := emit(first+uint64(bidx), true); err != nil {
+					return err
+				}
+			}
+		}
+		return nil
+	})
+	if err != nil || run.Count == 0 {
+		return err
+	}
+	return fn(run)
+}
+
+// Build maps of the extents of a snapshot that are newer than an ancestor (or all of them, with a zero base) and
+// of the extents of the ancestor and older snapshots, in a single pass over extent metadata. In both maps the
+// nearest snapshot holding an extent takes precedence. Also return the volume holding the snapshot.
+func getDiffExtentMaps(dc *DeviceContext, snapshotId uint, baseSnapshotId uint) (*VolumeMetadata, *ExtentMap, *ExtentMap, error) {
+	var v *VolumeMetadata
+	if snapshotId <= MAX_SNAPSHOTS {
+		v = dc.FindVolumeWithSnapshot(uint16(snapshotId))
+	}
+	if v == nil {
+		return nil, nil, nil, fmt.Errorf("snapshot %v not found", snapshotId)
+	}
+	depth := make([]uint16, MAX_SNAPSHOTS+1)
+	dd := uint16(1)
+	for sid := uint16(snapshotId); sid > 0; sid = dc.snapshots[sid-1].ParentSnapshotId {
+		depth[sid] = dd
+		dd++
+	}
+	// Extents of snapshots from the base down are old, the rest are new
+	baseDepth := dd
+	if baseSnapshotId != 0 {
+		if baseSnapshotId > MAX_SNAPSHOTS || depth[baseSnapshotId] == 0 {
+			return nil, nil, nil, fmt.Errorf("snapshot %v is not an ancestor of snapshot %v", baseSnapshotId, snapshotId)
+		}
+		baseDepth = depth[baseSnapshotId]
+	}
+
+	newMap := newExtentMap(dc, v.VolumeSize)
+	oldMap := newExtentMap(dc, v.VolumeSize)
+	err := dc.ScanExtents(func(e *ExtentMetadata) bool {
+		return e.SnapshotId != 0 && depth[e.SnapshotId] != 0
+	}, func(e *ExtentMetadata, epos uint) {
+		if uint(e.ExtentPos) >= newMap.totalVolumeExtents {
+			return
+		}
+		em := newMap
+		if depth[e.SnapshotId] >= baseDepth {
+			em = oldMap
+		}
+		me := em.entry(e.ExtentPos)
+		if me.SnapshotId != 0 && depth[me.SnapshotId] < depth[e.SnapshotId] {
+			return
+		}
+		*me = *e
+		// Convert ExtentPos from position in volume to position in device
+		me.ExtentPos = uint32(epos)
+	})
+	if err != nil {
+		return nil, nil, nil, err
+	}
+	return v, newMap, oldMap, nil
+}
+
+func DiffSnapshots(device string, snapshotId uint, baseSnapshotId uint, fn func(r BlockRange) error) error {
+	return withDevice(device, func(d *Device) error {
+		return d.DiffSnapshots(snapshotId, baseSnapshotId, fn)
+	})
+}
@@ -15,172 +15,308 @@
 package dbs
 
 import (
+	"errors"
+	"sync"
+	"sync/atomic"
+
 	"github.com/kelindar/bitmap"
 )
 
 const (
 	EXTENT_BATCH = 65536
+	COPY_WORKERS = 16 // Extents copied concurrently when copying a whole map
+
+	EXTENT_PAGE_BITS    = 9
+	EXTENT_PAGE_ENTRIES = 1 << EXTENT_PAGE_BITS // Extents per map page
+	EXTENT_PAGE_MASK    = EXTENT_PAGE_ENTRIES - 1
 )
 
-// Map of the whole volume. Empty extents have an empty snapshot identifier. The extent bitmap is used to speed up operations.
+var errStopped = errors.New("stopped")
+
+// A page of map entries. Allocation hints look at the entries next to the one being allocated, which other
+// writers may be updating under other locks, so the device position of each entry, plus one, is mirrored in an
+// atomic. A position may be stale, which only makes for a worse hint.
+type extentPage struct {
+	extents   [EXTENT_PAGE_ENTRIES]ExtentMetadata
+	positions [EXTENT_PAGE_ENTRIES]atomic.Uint32
+}
+
+// Map of the whole volume. Empty extents have an empty snapshot identifier. The map is a two-level page table keyed
+// by extent index, so memory is proportional to the allocated part of the volume. Pages are only allocated when an
+// extent in them is mapped and are installed atomically, as extents sharing a page may be protected by different
+// locks; entries themselves are protected by the caller.
 type ExtentMap struct {
 	dc                 *DeviceContext
 	totalVolumeExtents uint
-	extentBitmap       bitmap.Bitmap
-	extents            []ExtentMetadata
+	pages              []atomic.Pointer[extentPage]
 }
 
-// Get the map of a specific snapshot.
-func GetSnapshotExtentMap(dc *DeviceContext, deviceSize uint64, snapshotId uint16) (*ExtentMap, error) {
-	sem := &ExtentMap{
+func newExtentMap(dc *DeviceContext, deviceSize uint64) *ExtentMap {
+	totalVolumeExtents := uint(deviceSize / uint64(dc.extentSize))
+	return &ExtentMap{
 		dc:                 dc,
-		totalVolumeExtents: uint(deviceSize / EXTENT_SIZE),
+		totalVolumeExtents: totalVolumeExtents,
+		pages:              make([]atomic.Pointer[extentPage], divRoundUp(totalVolumeExtents, EXTENT_PAGE_ENTRIES)),
+	}
+}
+
+// Get the entry of an extent, or nil if the extent is not mapped.
+func (em *ExtentMap) lookup(eidx uint32) *ExtentMetadata {
+	p := em.pages[eidx>>EXTENT_PAGE_BITS].Load()
+	if p == nil {
+		return nil
 	}
-	sem.extentBitmap.Grow(uint32(sem.totalVolumeExtents - 1))
-	sem.extents = make([]ExtentMetadata, sem.totalVolumeExtents)
+	return &p.extents[eidx&EXTENT_PAGE_MASK]
+}
+
+// Get the entry of an extent, allocating its page if needed.
+func (em *ExtentMap) entry(eidx uint32) *ExtentMetadata {
+	pp := &em.pages[eidx>>EXTENT_PAGE_BITS]
+	p := pp.Load()
+	if p == nil {
+		// Another writer may install the page first
+		pp.CompareAndSwap(nil, new(extentPage))
+		p = pp.Load()
+	}
+	return &p.extents[eidx&EXTENT_PAGE_MASK]
+}
+
+// Point a mapped extent to a device position.
+func (em *ExtentMap) place(eidx uint32, snapshotId uint16, epos uint32) {
+	e := em.entry(eidx)
+	e.SnapshotId = snapshotId
+	e.ExtentPos = epos
+	em.pages[eidx>>EXTENT_PAGE_BITS].Load().positions[eidx&EXTENT_PAGE_MASK].Store(epos + 1)
+}
+
+// Get the device position of an extent for allocation hints, if it was ever mapped.
+func (em *ExtentMap) position(eidx uint32) (uint32, bool) {
+	p := em.pages[eidx>>EXTENT_PAGE_BITS].Load()
+	if p == nil {
+		return 0, false
+	}
+	epos := p.positions[eidx&EXTENT_PAGE_MASK].Load()
+	return epos - 1, epos != 0
+}
 
-	eb := make([]ExtentMetadata, EXTENT_BATCH)
-	remaining := min(dc.totalDeviceExtents, uint(dc.superblock.AllocatedDeviceExtents))
-	for offset := uint(0); offset < remaining; offset += EXTENT_BATCH {
-		size := min(remaining-offset, EXTENT_BATCH)
-		if err := dc.ReadExtents(eb[:size], offset); err != nil {
-			return nil, err
+// Call fn for all mapped extents in order, stopping at the first error.
+func (em *ExtentMap) forEach(fn func(eidx uint32, e *ExtentMetadata) error) error {
+	for i := range em.pages {
+		p := em.pages[i].Load()
+		if p == nil {
+			continue
 		}
-		for i := uint(0); i < size; i++ {
-			if eb[i].SnapshotId == snapshotId {
-				eidx := eb[i].ExtentPos
-				sem.extentBitmap.Set(eidx)
-				sem.extents[eidx] = eb[i]
-				// Convert ExtentPos from position in volume to position in device
-				sem.extents[eidx].ExtentPos = uint32(offset + i)
+		for j := range p.extents {
+			if p.extents[j].SnapshotId == 0 {
+				continue
+			}
+			if err := fn(uint32(i<<EXTENT_PAGE_BITS+j), &p.extents[j]); err != nil {
+				return err
 			}
 		}
 	}
-	return sem, nil
+	return nil
+}
+
+// Count the mapped extents.
+func (em *ExtentMap) Count() uint {
+	count := uint(0)
+	em.forEach(func(eidx uint32, e *ExtentMetadata) error {
+		count++
+		return nil
+	})
+	return count
+}
+
+// Get the map of a specific snapshot.
+func GetSnapshotExtentMap(dc *DeviceContext, deviceSize uint64, snapshotId uint16) (*ExtentMap, error) {
+	depth := make([]uint16, MAX_SNAPSHOTS+1)
+	depth[snapshotId] = 1
+	return getExtentMap(dc, deviceSize, depth)
 }
 
 // Get the map of a volume starting at a snapshot and including all ancestors.
 func GetVolumeExtentMap(dc *DeviceContext, deviceSize uint64, snapshotId uint16) (*ExtentMap, error) {
-	vem, err := GetSnapshotExtentMap(dc, deviceSize, snapshotId)
-	if err != nil {
-		return nil, err
+	depth := make([]uint16, MAX_SNAPSHOTS+1)
+	d := uint16(1)
+	for sid := snapshotId; sid > 0; sid = dc.snapshots[sid-1].ParentSnapshotId {
+		depth[sid] = d
+		d++
 	}
+	return getExtentMap(dc, deviceSize, depth)
+}
 
-	sid := snapshotId
-	for sid := dc.snapshots[sid-1].ParentSnapshotId; sid > 0; sid = dc.snapshots[sid-1].ParentSnapshotId {
-		sem, err := GetSnapshotExtentMap(dc, deviceSize, sid)
-		if err != nil {
-			return nil, err
+// Build a map from all extents belonging to the snapshots with non-zero depth, in a single pass over extent
+// metadata. When multiple snapshots hold the same extent, the one with the lowest depth takes precedence.
+func getExtentMap(dc *DeviceContext, deviceSize uint64, depth []uint16) (*ExtentMap, error) {
+	em := newExtentMap(dc, deviceSize)
+	err := dc.ScanExtents(func(e *ExtentMetadata) bool {
+		return e.SnapshotId != 0 && depth[e.SnapshotId] != 0
+	}, func(e *ExtentMetadata, epos uint) {
+		if uint(e.ExtentPos) >= em.totalVolumeExtents {
+			return
 		}
-		sem.extentBitmap.Range(func(x uint32) {
-			if vem.extents[x].SnapshotId == 0 {
-				vem.extents[x] = sem.extents[x]
-				vem.extentBitmap.Set(x)
-			}
-		})
+		eidx := e.ExtentPos
+		me := em.entry(eidx)
+		if me.SnapshotId != 0 && depth[me.SnapshotId] < depth[e.SnapshotId] {
+			return
+		}
+		*me = *e
+		// Convert ExtentPos from position in volume to position in device
+		em.place(eidx, e.SnapshotId, uint32(epos))
+	})
+	if err != nil {
+		return nil, err
 	}
-	return vem, nil
+	return em, nil
 }
 
 // Write extent metadata to the device.
 func (em *ExtentMap) WriteExtent(eidx uint32) error {
-	e := em.extents[eidx]
+	e := *em.lookup(eidx)
 	// Convert ExtentPos from position in device to position in volume
 	e.ExtentPos = eidx
-	return em.dc.WriteExtent(&e, uint(em.extents[eidx].ExtentPos))
+	return em.dc.WriteExtent(&e, uint(em.lookup(eidx).ExtentPos))
+}
+
+// Get the preferred device position for an extent, next to its neighbors in the map.
+func (em *ExtentMap) allocationHint(eidx uint32) uint32 {
+	if eidx > 0 {
+		if epos, ok := em.position(eidx - 1); ok {
+			return epos + 1
+		}
+	}
+	if uint(eidx+1) < em.totalVolumeExtents {
+		if epos, ok := em.position(eidx + 1); ok && epos > 0 {
+			return epos - 1
+		}
+	}
+	return NO_HINT
 }
 
 // Allocate a new extent into the map.
 func (em *ExtentMap) NewExtentToSnapshot(eidx uint32, snapshotId uint16) error {
-	em.extents[eidx].SnapshotId = snapshotId
-	em.extents[eidx].ExtentPos = em.dc.superblock.AllocatedDeviceExtents
-	if err := em.WriteExtent(eidx); err != nil {
+	pdst, err := em.dc.AllocateExtent(em.allocationHint(eidx))
+	if err != nil {
 		return err
 	}
-	em.dc.superblock.AllocatedDeviceExtents++
-	return nil
+	em.place(eidx, snapshotId, pdst)
+	return em.WriteExtent(eidx)
 }
 
 // Copy over all data from an extent to another snapshot and update the map.
 func (em *ExtentMap) CopyExtentToSnapshot(eidx uint32, snapshotId uint16) error {
-	psrc := em.extents[eidx].ExtentPos
-	pdst := em.dc.superblock.AllocatedDeviceExtents
-	if err := em.dc.CopyExtentData(uint(psrc), uint(pdst)); err != nil {
+	if err := em.copyExtent(eidx, snapshotId, 0, 0); err != nil {
 		return err
 	}
-	em.extents[eidx].SnapshotId = snapshotId
-	em.extents[eidx].ExtentPos = pdst
-	if err := em.WriteExtent(eidx); err != nil {
+	return em.WriteExtent(eidx)
+}
+
+// Copy an extent to another snapshot, without writing its metadata. Only allocated blocks are copied, except for
+// blocks [bidx, bidx+count), which the caller is about to overwrite before writing the metadata.
+func (em *ExtentMap) copyExtent(eidx uint32, snapshotId uint16, bidx uint, count uint) error {
+	e := em.lookup(eidx)
+	pdst, err := em.dc.AllocateExtent(em.allocationHint(eidx))
+	if err != nil {
+		return err
+	}
+	blocks := e.BlockBitmap
+	bb := bitmap.FromBytes(blocks[:])
+	for i := bidx; i < bidx+count; i++ {
+		bb.Remove(uint32(i))
+	}
+	if err := em.dc.CopyExtentData(uint(e.ExtentPos), uint(pdst), bb); err != nil {
+		// Nothing records the new extent yet
+		em.dc.releaseClearedExtents([]uint{uint(pdst)})
 		return err
 	}
-	em.dc.superblock.AllocatedDeviceExtents++
+	em.place(eidx, snapshotId, pdst)
 	return nil
 }
 
-// Copy the whole map to another snapshot.
+// Copy the whole map to another snapshot. Extents are copied by multiple workers, while their metadata
+// is queued and written back in coalesced runs.
 func (em *ExtentMap) CopyAllToSnapshot(snapshotId uint16) error {
-	var cbErr error
-	em.extentBitmap.Range(func(x uint32) {
-		if cbErr != nil {
-			return
-		}
-		if err := em.CopyExtentToSnapshot(x, snapshotId); err != nil {
-			cbErr = err
-			return
+	eidxs := make(chan uint32, COPY_WORKERS)
+	errs := make(chan error, COPY_WORKERS)
+	quit := make(chan struct{})
+	var stop sync.Once
+	var wg sync.WaitGroup
+	for i := 0; i < COPY_WORKERS; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for eidx := range eidxs {
+				if err := em.CopyExtentToSnapshot(eidx, snapshotId); err != nil {
+					errs <- err
+					stop.Do(func() { close(quit) })
+					return
+				}
+			}
+		}()
+	}
+	em.forEach(func(eidx uint32, e *ExtentMetadata) error {
+		select {
+		case eidxs <- eidx:
+			return nil
+		case <-quit:
+			return errStopped
 		}
 	})
-	if cbErr != nil {
-		return cbErr
+	close(eidxs)
+	wg.Wait()
+	select {
+	case err := <-errs:
+		return err
+	default:
+		return nil
 	}
-	return nil
-
 }
 
-// Clear all metadata included in the map.
-func (em *ExtentMap) MergeAllInto(emdst *ExtentMap, snapshotId uint16) error {
-	var cbErr error
-	em.extentBitmap.Range(func(x uint32) {
-		if cbErr != nil {
-			return
-		}
-		if emdst.extents[x].SnapshotId != 0 {
+// Merge a snapshot into its child with a single scan of extent metadata. Extents only the snapshot holds are
+// moved to the child; extents both hold are dropped, as the child's copy already has all blocks that are live
+// for it. Only the metadata of the snapshot's extents is written, as coalesced batches on flush.
+func MergeSnapshot(dc *DeviceContext, deviceSize uint64, snapshotId uint16, childSnapshotId uint16) error {
+	totalVolumeExtents := uint(deviceSize / uint64(dc.extentSize))
+	type sourceExtent struct {
+		epos uint
+		e    ExtentMetadata
+	}
+	var src []sourceExtent
+	var srcExtents, dstExtents bitmap.Bitmap
+	err := dc.ScanExtents(func(e *ExtentMetadata) bool {
+		return e.SnapshotId == snapshotId || e.SnapshotId == childSnapshotId
+	}, func(e *ExtentMetadata, epos uint) {
+		if e.SnapshotId == childSnapshotId {
+			if uint(e.ExtentPos) < totalVolumeExtents {
+				dstExtents.Set(e.ExtentPos)
+			}
 			return
 		}
-		emdst.extents[x] = em.extents[x]
-		emdst.extents[x].SnapshotId = snapshotId
-		emdst.extentBitmap.Set(x)
-		em.extents[x] = ExtentMetadata{}
-		em.extentBitmap.Remove(x)
-		e := em.extents[x]
-		// Convert ExtentPos from position in device to position in volume
-		e.ExtentPos = x
-		if err := em.dc.WriteExtent(&e, uint(em.extents[x].ExtentPos)); err != nil {
-			cbErr = err
-			return
+		src = append(src, sourceExtent{epos, *e})
+		if uint(e.ExtentPos) < totalVolumeExtents {
+			srcExtents.Set(e.ExtentPos)
 		}
 	})
-	if cbErr != nil {
-		return cbErr
+	if err != nil {
+		return err
 	}
-	return nil
-}
-
-// Clear all metadata included in the map.
-func (em *ExtentMap) ClearAll() error {
-	var e ExtentMetadata
-	var cbErr error
-	em.extentBitmap.Range(func(x uint32) {
-		if cbErr != nil {
-			return
+	moved := srcExtents.Clone(nil)
+	moved.AndNot(dstExtents)
+	var empty ExtentMetadata
+	for i := range src {
+		e := &src[i].e
+		if !moved.Contains(e.ExtentPos) {
+			// Shared, or past the end of the volume
+			if err := dc.WriteExtent(&empty, src[i].epos); err != nil {
+				return err
+			}
+			continue
 		}
-		eidx := em.extents[x].ExtentPos
-		if err := em.dc.WriteExtent(&e, uint(eidx)); err != nil {
-			cbErr = err
-			return
+		e.SnapshotId = childSnapshotId
+		if err := dc.WriteExtent(e, src[i].epos); err != nil {
+			return err
 		}
-	})
-	if cbErr != nil {
-		return cbErr
 	}
 	return nil
 }
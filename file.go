@@ -22,13 +22,41 @@ import (
 	"github.com/ncw/directio"
 )
 
+type IOEngine int
+
+const (
+	IO_ENGINE_SYNC  IOEngine = iota // Blocking pread/pwrite per request
+	IO_ENGINE_URING                 // Asynchronous submission through io_uring (Linux only)
+)
+
+// I/O engine used when opening devices. If io_uring is not available, the synchronous engine is used instead.
+var DefaultIOEngine = IO_ENGINE_SYNC
+
+func ParseIOEngine(name string) (IOEngine, error) {
+	switch name {
+	case "sync":
+		return IO_ENGINE_SYNC, nil
+	case "uring":
+		return IO_ENGINE_URING, nil
+	}
+	return IO_ENGINE_SYNC, fmt.Errorf("unknown I/O engine %v", name)
+}
+
+func (engine IOEngine) String() string {
+	if engine == IO_ENGINE_URING {
+		return "uring"
+	}
+	return "sync"
+}
+
 // Wrapper to file object supporting direct I/O
 type DirectFile struct {
 	*os.File
 	Name string
+	ring *uring // Set when using the io_uring engine
 }
 
-func NewDirectFile(name string, flag int, perm os.FileMode) (*DirectFile, error) {
+func NewDirectFile(name string, flag int, perm os.FileMode, engine IOEngine) (*DirectFile, error) {
 	file, err := directio.OpenFile(name, flag, perm)
 	if err != nil {
 		return nil, err
@@ -37,9 +65,23 @@ func NewDirectFile(name string, flag int, perm os.FileMode) (*DirectFile, error)
 		File: file,
 		Name: name,
 	}
+	if engine == IO_ENGINE_URING {
+		// Fall back to synchronous I/O if the ring cannot be set up
+		if ring, err := newURing(int(file.Fd())); err == nil {
+			df.ring = ring
+		}
+	}
 	return df, nil
 }
 
+// Get the engine actually in use.
+func (file *DirectFile) Engine() IOEngine {
+	if file.ring != nil {
+		return IO_ENGINE_URING
+	}
+	return IO_ENGINE_SYNC
+}
+
 func (file *DirectFile) Size() (int64, error) {
 	pos, err := file.File.Seek(0, io.SeekEnd)
 	if err != nil {
@@ -48,30 +90,139 @@ func (file *DirectFile) Size() (int64, error) {
 	return pos, nil
 }
 
-// Read using direct I/O
+// A read or write request for asynchronous submission. The data must not be touched until the request completes.
+type IORequest struct {
+	Data   []byte
+	Offset uint64
+	Write  bool
+	buf    []byte  // Aligned buffer used for the transfer
+	bounce *buffer // Pooled buffer backing buf, for unaligned data
+	n      int
+	err    error
+	done   chan struct{}
+}
+
+// Wait for the request to complete and return the bytes transferred.
+func (req *IORequest) Wait() (int, error) {
+	<-req.done
+	return req.n, req.err
+}
+
+func (req *IORequest) prepare() {
+	req.buf = req.Data
+	if !directio.IsAligned(req.Data) {
+		req.bounce = getBuffer(len(req.Data))
+		req.buf = req.bounce.b
+		if req.Write {
+			copy(req.buf, req.Data)
+		}
+	}
+	req.n = 0
+	req.err = nil
+	req.done = make(chan struct{})
+}
+
+// Record the result of a request and wake up waiters.
+func (req *IORequest) complete(n int, err error) {
+	if err == nil && n < len(req.buf) {
+		if req.Write {
+			err = io.ErrShortWrite
+		} else {
+			err = io.EOF
+		}
+	}
+	if req.bounce != nil {
+		if !req.Write {
+			copy(req.Data, req.buf[:n])
+		}
+		req.bounce.release()
+		req.bounce = nil
+	}
+	req.buf = nil
+	req.n = n
+	req.err = err
+	close(req.done)
+}
+
+// Queue requests for execution. With the synchronous engine, requests are executed before returning.
+func (file *DirectFile) Submit(reqs ...*IORequest) error {
+	for _, req := range reqs {
+		req.prepare()
+	}
+	if file.ring != nil {
+		return file.ring.submit(reqs)
+	}
+	for _, req := range reqs {
+		var n int
+		var err error
+		if req.Write {
+			n, err = file.File.WriteAt(req.buf, int64(req.Offset))
+		} else {
+			n, err = file.File.ReadAt(req.buf, int64(req.Offset))
+		}
+		req.complete(n, err)
+	}
+	return nil
+}
+
+// Execute requests concurrently and wait for all of them. Returns the first error.
+func (file *DirectFile) SubmitAndWait(reqs ...*IORequest) error {
+	if err := file.Submit(reqs...); err != nil {
+		return err
+	}
+	var err error
+	for _, req := range reqs {
+		if _, rerr := req.Wait(); err == nil && rerr != nil {
+			err = rerr
+		}
+	}
+	return err
+}
+
+// Read using direct I/O. Aligned buffers are used in place, others go through a pooled bounce buffer.
 func (file *DirectFile) ReadAt(data []byte, offset uint64) (int, error) {
+	if file.ring != nil {
+		req := &IORequest{Data: data, Offset: offset}
+		if err := file.Submit(req); err != nil {
+			return 0, err
+		}
+		return req.Wait()
+	}
 	if directio.IsAligned(data) {
 		return file.File.ReadAt(data, int64(offset))
 	}
-	buf := directio.AlignedBlock(len(data))
-	n, err := file.File.ReadAt(buf, int64(offset))
+	buf := getBuffer(len(data))
+	defer buf.release()
+	n, err := file.File.ReadAt(buf.b, int64(offset))
 	if err == nil {
-		copy(data, buf)
+		copy(data, buf.b)
 	}
 	return n, err
 }
 
-// Write using direct I/O
+// Write using direct I/O. Aligned buffers are used in place, others go through a pooled bounce buffer.
 func (file *DirectFile) WriteAt(data []byte, offset uint64) (int, error) {
+	if file.ring != nil {
+		req := &IORequest{Data: data, Offset: offset, Write: true}
+		if err := file.Submit(req); err != nil {
+			return 0, err
+		}
+		return req.Wait()
+	}
 	if directio.IsAligned(data) {
 		return file.File.WriteAt(data, int64(offset))
 	}
-	buf := directio.AlignedBlock(len(data))
-	copy(buf, data)
-	return file.File.WriteAt(buf, int64(offset))
+	buf := getBuffer(len(data))
+	defer buf.release()
+	copy(buf.b, data)
+	return file.File.WriteAt(buf.b, int64(offset))
 }
 
+// Close the file. Data is not synced; callers needing durability sync first (see DeviceContext.Sync).
 func (file *DirectFile) Close() error {
-	// file.File.Sync()
+	if file.ring != nil {
+		file.ring.close()
+		file.ring = nil
+	}
 	return file.File.Close()
 }
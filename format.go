@@ -0,0 +1,132 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"sync"
+	"sync/atomic"
+)
+
+const (
+	MAGIC_INIT = "DBS@INI!" // Superblock magic while a device is being initialized
+
+	INIT_CHECKPOINT = 1 << 20 // Extents cleared between progress checkpoints (1 TB of data with 1 MB extents)
+	INIT_WRITE_SIZE = 1 << 20 // Size of each zero write, when the device cannot zero ranges itself
+	INIT_WORKERS    = 16      // Zero writes in flight
+)
+
+// Clear the metadata of all extents, the bulk of initializing a device. Ranges are zeroed by the device where
+// supported (see zeroFile), or otherwise written with parallel aligned writes; either way, there is no
+// read-modify-write. The superblock is replaced by one with MAGIC_INIT first, so that the device is not opened
+// while partially cleared, and records progress every INIT_CHECKPOINT extents. Initializing the device again
+// with the same geometry resumes from the last checkpoint.
+func (dc *DeviceContext) clearExtents() error {
+	start := dc.initProgress()
+	if err := dc.checkpointInit(start); err != nil {
+		return err
+	}
+	for start < dc.totalDeviceExtents {
+		end := min(start+INIT_CHECKPOINT, dc.totalDeviceExtents)
+		// Whole metadata blocks covering the extents
+		first := (dc.extentOffset + start*SIZEOF_EXTENT_METADATA) / BLOCK_SIZE * BLOCK_SIZE
+		last := divRoundUp(dc.extentOffset+end*SIZEOF_EXTENT_METADATA, BLOCK_SIZE) * BLOCK_SIZE
+		if err := dc.zeroMetadata(uint64(first), uint64(last-first)); err != nil {
+			return fmt.Errorf("failed to clear extent metadata: %w", err)
+		}
+		if err := dc.checkpointInit(end); err != nil {
+			return err
+		}
+		start = end
+	}
+	return nil
+}
+
+// Get the extents already cleared by an interrupted initialization with the same geometry.
+func (dc *DeviceContext) initProgress() uint {
+	var sb Superblock
+	buf := getBuffer(BLOCK_SIZE)
+	defer buf.release()
+	if _, err := dc.readMetadataAt(buf.b, 0); err != nil {
+		return 0
+	}
+	sb.decode(buf.b)
+	if string(sb.Magic[:]) != MAGIC_INIT || sb.Version != dc.superblock.Version || sb.DeviceSize != dc.superblock.DeviceSize ||
+		sb.BlockSize != dc.superblock.BlockSize || sb.ExtentSize != dc.superblock.ExtentSize {
+		return 0
+	}
+	return min(uint(sb.ClearedExtents), dc.totalDeviceExtents)
+}
+
+// Make the metadata cleared so far durable and record it in the superblock.
+func (dc *DeviceContext) checkpointInit(clearedExtents uint) error {
+	if err := dc.syncMetadata(); err != nil {
+		return err
+	}
+	if err := dc.f.Sync(); err != nil {
+		return fmt.Errorf("cannot sync device: %w", err)
+	}
+	sb := *dc.superblock
+	copy(sb.Magic[:], MAGIC_INIT)
+	sb.ClearedExtents = uint32(clearedExtents)
+	buf := getBuffer(BLOCK_SIZE)
+	defer buf.release()
+	clear(buf.b)
+	sb.encode(buf.b)
+	dc.metrics.metadataWrites.Add(1)
+	if _, err := dc.writeMetadataAt(buf.b, 0); err != nil {
+		return fmt.Errorf("failed to write superblock: %w", err)
+	}
+	return nil
+}
+
+// Zero a block aligned range of the metadata area.
+func (dc *DeviceContext) zeroMetadata(offset uint64, length uint64) error {
+	if dc.mapping == nil && zeroFile(dc.f.File, offset, length) == nil {
+		return nil
+	}
+	buf := getBuffer(INIT_WRITE_SIZE)
+	defer buf.release()
+	clear(buf.b)
+	var next atomic.Uint64
+	next.Store(offset)
+	var wg sync.WaitGroup
+	var errLock sync.Mutex
+	var err error
+	for i := 0; i < INIT_WORKERS; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for {
+				woffset := next.Add(INIT_WRITE_SIZE) - INIT_WRITE_SIZE
+				if woffset >= offset+length {
+					return
+				}
+				if _, werr := dc.writeMetadataAt(buf.b[:min(INIT_WRITE_SIZE, offset+length-woffset)], woffset); werr != nil {
+					errLock.Lock()
+					if err == nil {
+						err = werr
+					}
+					errLock.Unlock()
+					// Stop the other workers
+					next.Store(offset + length)
+					return
+				}
+			}
+		}()
+	}
+	wg.Wait()
+	return err
+}
@@ -0,0 +1,104 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+// In-memory indexes over the volume and snapshot tables, so that lookups and slot allocation do not scan them.
+// Built when the tables are read and kept up to date by the device context mutators. Snapshot arrays are
+// indexed by snapshot identifier - 1; volume indices are stored + 1, so that zero means none.
+type metadataIndex struct {
+	names         map[[MAX_VOLUME_NAME_SIZE + 1]byte]uint16 // Volume index by name
+	heads         [MAX_SNAPSHOTS]uint16                     // Volume index + 1 having the snapshot as current
+	firstChild    [MAX_SNAPSHOTS]uint16                     // Children are kept in ascending identifier order
+	nextSibling   [MAX_SNAPSHOTS]uint16
+	freeVolumes   freeSet
+	freeSnapshots freeSet
+}
+
+// Rebuild all indexes from the tables.
+func (dc *DeviceContext) indexMetadata() {
+	idx := &dc.index
+	idx.names = make(map[[MAX_VOLUME_NAME_SIZE + 1]byte]uint16)
+	idx.heads = [MAX_SNAPSHOTS]uint16{}
+	idx.firstChild = [MAX_SNAPSHOTS]uint16{}
+	idx.nextSibling = [MAX_SNAPSHOTS]uint16{}
+	idx.freeVolumes = freeSet{}
+	idx.freeSnapshots = freeSet{}
+	for vidx := range dc.volumes {
+		v := &dc.volumes[vidx]
+		if v.SnapshotId == 0 {
+			idx.freeVolumes.add(uint32(vidx))
+			continue
+		}
+		idx.names[v.VolumeName] = uint16(vidx)
+		idx.heads[v.SnapshotId-1] = uint16(vidx) + 1
+	}
+	// Prepending in descending order leaves children sorted
+	for sidx := MAX_SNAPSHOTS - 1; sidx >= 0; sidx-- {
+		s := &dc.snapshots[sidx]
+		if s.CreatedAt == 0 {
+			idx.freeSnapshots.add(uint32(sidx))
+			continue
+		}
+		if p := s.ParentSnapshotId; p != 0 {
+			idx.nextSibling[sidx] = idx.firstChild[p-1]
+			idx.firstChild[p-1] = uint16(sidx) + 1
+		}
+	}
+}
+
+// Add a snapshot to the children of its parent.
+func (idx *metadataIndex) linkSnapshot(snapshotId uint16, parentSnapshotId uint16) {
+	if parentSnapshotId == 0 {
+		return
+	}
+	next := &idx.firstChild[parentSnapshotId-1]
+	for *next != 0 && *next < snapshotId {
+		next = &idx.nextSibling[*next-1]
+	}
+	idx.nextSibling[snapshotId-1] = *next
+	*next = snapshotId
+}
+
+// Remove a snapshot from the children of its parent.
+func (idx *metadataIndex) unlinkSnapshot(snapshotId uint16, parentSnapshotId uint16) {
+	if parentSnapshotId == 0 {
+		return
+	}
+	for next := &idx.firstChild[parentSnapshotId-1]; *next != 0; next = &idx.nextSibling[*next-1] {
+		if *next == snapshotId {
+			*next = idx.nextSibling[snapshotId-1]
+			idx.nextSibling[snapshotId-1] = 0
+			return
+		}
+	}
+}
+
+// Find snapshots not in the chain of any volume. These are left behind by volume deletions that did not get to
+// clear their extents.
+func (dc *DeviceContext) FindOrphanSnapshots() []uint16 {
+	reachable := make([]bool, MAX_SNAPSHOTS+1)
+	for vidx := range dc.volumes {
+		for sid := dc.volumes[vidx].SnapshotId; sid > 0 && !reachable[sid]; sid = dc.snapshots[sid-1].ParentSnapshotId {
+			reachable[sid] = true
+		}
+	}
+	var orphans []uint16
+	for sidx := range dc.snapshots {
+		if dc.snapshots[sidx].CreatedAt != 0 && !reachable[sidx+1] {
+			orphans = append(orphans, uint16(sidx)+1)
+		}
+	}
+	return orphans
+}
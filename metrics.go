@@ -0,0 +1,160 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"bytes"
+	"math/bits"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	METRIC_SHARDS   = 16 // Independently updated parts of volume metrics, selected by extent index
+	LATENCY_BUCKETS = 24 // Power-of-two latency buckets, from below 1 µs to 2^22 µs and above
+)
+
+// A latency histogram. Bucket i counts latencies below 2^i µs (and at least half that), except for the last one,
+// which counts everything above.
+type latencyHistogram struct {
+	buckets [LATENCY_BUCKETS]atomic.Uint64
+	sum     atomic.Uint64 // Nanoseconds
+}
+
+func (h *latencyHistogram) observe(start time.Time) {
+	d := time.Since(start)
+	h.buckets[min(bits.Len64(uint64(d.Microseconds())), LATENCY_BUCKETS-1)].Add(1)
+	h.sum.Add(uint64(d))
+}
+
+type LatencyStats struct {
+	Count   uint64
+	Sum     time.Duration
+	Buckets [LATENCY_BUCKETS]uint64 // Not cumulative
+}
+
+func (s *LatencyStats) add(h *latencyHistogram) {
+	for i := range h.buckets {
+		n := h.buckets[i].Load()
+		s.Buckets[i] += n
+		s.Count += n
+	}
+	s.Sum += time.Duration(h.sum.Load())
+}
+
+// Upper bound of a latency bucket. The last bucket has no bound and returns zero.
+func LatencyBucketBound(i int) time.Duration {
+	if i >= LATENCY_BUCKETS-1 {
+		return 0
+	}
+	return time.Duration(1<<i) * time.Microsecond
+}
+
+// Counters of a volume context. Requests update the shard of the extent they start in, so that requests to
+// different extents rarely share cache lines, as with extent locks. Shards are padded to a multiple of the cache
+// line size.
+type volumeCounters struct {
+	reads         atomic.Uint64
+	writes        atomic.Uint64
+	unmaps        atomic.Uint64
+	readBytes     atomic.Uint64
+	writtenBytes  atomic.Uint64
+	holeBlocks    atomic.Uint64 // Blocks read as zeros without I/O
+	copiedExtents atomic.Uint64 // Extents copied from a previous snapshot
+	readLatency   latencyHistogram
+	writeLatency  latencyHistogram
+	_             [56]byte
+}
+
+type VolumeStats struct {
+	Reads         uint64
+	Writes        uint64
+	Unmaps        uint64 // Unmap and write zeroes requests
+	ReadBytes     uint64
+	WrittenBytes  uint64
+	HoleBlocks    uint64 // Blocks read as zeros without I/O
+	CopiedExtents uint64 // Extents copied from a previous snapshot (copy-on-write)
+	ReadLatency   LatencyStats
+	WriteLatency  LatencyStats
+}
+
+// Get the counters shard for a request starting at the given block.
+func (vc *VolumeContext) counters(block uint64) *volumeCounters {
+	return &vc.metrics[(block>>vc.dc.blockBitsInExtent)%METRIC_SHARDS]
+}
+
+// Get the statistics of the volume since it was opened.
+func (vc *VolumeContext) Stats() VolumeStats {
+	var s VolumeStats
+	for i := range vc.metrics {
+		m := &vc.metrics[i]
+		s.Reads += m.reads.Load()
+		s.Writes += m.writes.Load()
+		s.Unmaps += m.unmaps.Load()
+		s.ReadBytes += m.readBytes.Load()
+		s.WrittenBytes += m.writtenBytes.Load()
+		s.HoleBlocks += m.holeBlocks.Load()
+		s.CopiedExtents += m.copiedExtents.Load()
+		s.ReadLatency.add(&m.readLatency)
+		s.WriteLatency.add(&m.writeLatency)
+	}
+	return s
+}
+
+// Counters of a device context. These are updated off the block hot path, or under locks held anyway.
+type deviceCounters struct {
+	allocatedExtents atomic.Uint64
+	metadataWrites   atomic.Uint64
+	extentFlushes    atomic.Uint64
+	syncRequests     atomic.Uint64
+	deviceSyncs      atomic.Uint64
+	cacheHits        atomic.Uint64
+	cacheMisses      atomic.Uint64
+}
+
+type DeviceStats struct {
+	AllocatedExtents uint64 // Extents handed out by AllocateExtent
+	MetadataWrites   uint64 // Metadata write I/Os, each a read-modify-write cycle for extent metadata
+	ExtentFlushes    uint64 // Batches of pending extent metadata updates written
+	SyncRequests     uint64
+	DeviceSyncs      uint64 // Device flushes, fewer than sync requests when these are grouped
+	CacheHits        uint64 // Blocks
+	CacheMisses      uint64 // Blocks
+}
+
+// Get the statistics of the device since it was opened.
+func (d *Device) Stats() DeviceStats {
+	m := &d.dc.metrics
+	return DeviceStats{
+		AllocatedExtents: m.allocatedExtents.Load(),
+		MetadataWrites:   m.metadataWrites.Load(),
+		ExtentFlushes:    m.extentFlushes.Load(),
+		SyncRequests:     m.syncRequests.Load(),
+		DeviceSyncs:      m.deviceSyncs.Load(),
+		CacheHits:        m.cacheHits.Load(),
+		CacheMisses:      m.cacheMisses.Load(),
+	}
+}
+
+// Get the statistics of all open volumes, by name.
+func (d *Device) VolumeStats() map[string]VolumeStats {
+	d.lock.RLock()
+	defer d.lock.RUnlock()
+	stats := make(map[string]VolumeStats, len(d.volumes))
+	for v, vc := range d.volumes {
+		stats[string(v.VolumeName[:bytes.IndexByte(v.VolumeName[:], 0)])] = vc.Stats()
+	}
+	return stats
+}
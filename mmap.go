@@ -0,0 +1,168 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"io"
+	"os"
+)
+
+type MetadataMode int
+
+const (
+	METADATA_MODE_DIRECT MetadataMode = iota // Metadata goes through direct I/O, like data
+	METADATA_MODE_MMAP                       // Metadata is memory-mapped (Linux only)
+)
+
+// Metadata mode used when opening devices. If the device cannot be mapped, or the metadata area does not end on a
+// page boundary, direct I/O is used instead.
+var DefaultMetadataMode = METADATA_MODE_DIRECT
+
+func ParseMetadataMode(name string) (MetadataMode, error) {
+	switch name {
+	case "direct":
+		return METADATA_MODE_DIRECT, nil
+	case "mmap":
+		return METADATA_MODE_MMAP, nil
+	}
+	return METADATA_MODE_DIRECT, fmt.Errorf("unknown metadata mode %v", name)
+}
+
+func (mode MetadataMode) String() string {
+	if mode == METADATA_MODE_MMAP {
+		return "mmap"
+	}
+	return "direct"
+}
+
+// A shared mapping of the metadata area, [0, DataOffset). Metadata reads and writes become copies, which suits
+// regular files, where small direct I/O read-modify-writes are slow. Data still uses direct I/O; the mapping is
+// only used if the metadata area ends on a page boundary, so that no page is accessed both ways. Writes only
+// reach the device when the mapping is synced, which happens at the same points where direct I/O metadata writes
+// are ordered: on Flush, between extent metadata and the superblock, and on Sync.
+type metadataMapping struct {
+	b     []byte
+	dirty [2]uint // Range of pages written since the last sync
+}
+
+// Map the metadata area if the mode asks for it.
+func (dc *DeviceContext) mapMetadata(mode MetadataMode) {
+	if mode != METADATA_MODE_MMAP {
+		return
+	}
+	// With small extents, the last page would overlap the data area, which syncing the mapping overwrites
+	if dc.dataOffset%uint(os.Getpagesize()) != 0 {
+		return
+	}
+	if b, err := mapFile(int(dc.f.Fd()), int(dc.dataOffset)); err == nil {
+		dc.mapping = &metadataMapping{b: b}
+	}
+}
+
+// Get the metadata mode actually in use.
+func (dc *DeviceContext) MetadataMode() MetadataMode {
+	if dc.mapping != nil {
+		return METADATA_MODE_MMAP
+	}
+	return METADATA_MODE_DIRECT
+}
+
+// Read metadata at the given device offset. The buffer should be aligned for direct I/O.
+func (dc *DeviceContext) readMetadataAt(data []byte, offset uint64) (int, error) {
+	m := dc.mapping
+	if m == nil {
+		return dc.f.ReadAt(data, offset)
+	}
+	if offset >= uint64(len(m.b)) {
+		return 0, io.EOF
+	}
+	n := copy(data, m.b[offset:])
+	if n < len(data) {
+		return n, io.EOF
+	}
+	return n, nil
+}
+
+// Write metadata at the given device offset. The buffer should be aligned for direct I/O.
+func (dc *DeviceContext) writeMetadataAt(data []byte, offset uint64) (int, error) {
+	m := dc.mapping
+	if m == nil {
+		return dc.f.WriteAt(data, offset)
+	}
+	if offset+uint64(len(data)) > uint64(len(m.b)) {
+		return 0, io.ErrShortWrite
+	}
+	dc.mappingLock.Lock()
+	n := copy(m.b[offset:], data)
+	m.markDirty(uint(offset), uint(n))
+	dc.mappingLock.Unlock()
+	return n, nil
+}
+
+// Run metadata requests, concurrently when using direct I/O.
+func (dc *DeviceContext) submitMetadata(reqs ...*IORequest) error {
+	if dc.mapping == nil {
+		return dc.f.SubmitAndWait(reqs...)
+	}
+	for _, req := range reqs {
+		var err error
+		if req.Write {
+			_, err = dc.writeMetadataAt(req.Data, req.Offset)
+		} else {
+			_, err = dc.readMetadataAt(req.Data, req.Offset)
+		}
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (m *metadataMapping) markDirty(offset uint, size uint) {
+	pageSize := uint(os.Getpagesize())
+	start, end := (offset/pageSize)*pageSize, divRoundUp(offset+size, pageSize)*pageSize
+	if m.dirty[0] == m.dirty[1] {
+		m.dirty = [2]uint{start, end}
+		return
+	}
+	m.dirty = [2]uint{min(m.dirty[0], start), max(m.dirty[1], end)}
+}
+
+// Write back metadata written to the mapping so far. A no-op when using direct I/O.
+func (dc *DeviceContext) syncMetadata() error {
+	m := dc.mapping
+	if m == nil {
+		return nil
+	}
+	dc.mappingLock.Lock()
+	dirty := m.dirty
+	m.dirty = [2]uint{}
+	dc.mappingLock.Unlock()
+	if err := syncMapping(m.b[dirty[0]:dirty[1]]); err != nil {
+		dc.mappingLock.Lock()
+		m.markDirty(dirty[0], dirty[1]-dirty[0])
+		dc.mappingLock.Unlock()
+		return err
+	}
+	return nil
+}
+
+func (dc *DeviceContext) unmapMetadata() {
+	if dc.mapping != nil {
+		unmapFile(dc.mapping.b)
+		dc.mapping = nil
+	}
+}
@@ -0,0 +1,45 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"syscall"
+	"unsafe"
+)
+
+// Map the start of a file shared, for reading and writing.
+func mapFile(fd int, size int) ([]byte, error) {
+	b, err := syscall.Mmap(fd, 0, size, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("cannot map metadata: %w", err)
+	}
+	return b, nil
+}
+
+func unmapFile(b []byte) error {
+	return syscall.Munmap(b)
+}
+
+// Write back a page aligned part of a mapping and wait for it.
+func syncMapping(b []byte) error {
+	if len(b) == 0 {
+		return nil
+	}
+	if _, _, errno := syscall.Syscall(syscall.SYS_MSYNC, uintptr(unsafe.Pointer(&b[0])), uintptr(len(b)), syscall.MS_SYNC); errno != 0 {
+		return fmt.Errorf("cannot sync metadata: %w", errno)
+	}
+	return nil
+}
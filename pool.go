@@ -0,0 +1,70 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"sync"
+
+	"github.com/ncw/directio"
+)
+
+// Size classes of pooled buffers, in increasing order: single blocks and whole extents of the default and the
+// largest geometry, and extent metadata batches (plus a block, as a batch may straddle block boundaries).
+var bufferClasses = [...]int{
+	BLOCK_SIZE,
+	MAX_BLOCK_SIZE,
+	EXTENT_SIZE,
+	int((divRoundUp(EXTENT_BATCH*SIZEOF_EXTENT_METADATA, BLOCK_SIZE) + 1) * BLOCK_SIZE),
+	MAX_BLOCK_SIZE * MAX_BLOCKS_IN_EXTENT,
+}
+
+var bufferPools [len(bufferClasses)]sync.Pool
+
+// An aligned buffer borrowed from a pool. Buffers larger than all classes are allocated and left to the GC.
+type buffer struct {
+	b     []byte
+	class int
+}
+
+// Get an aligned buffer of the given size from the smallest class that fits. Contents are undefined.
+func getBuffer(size int) *buffer {
+	for class, csize := range bufferClasses {
+		if size > csize {
+			continue
+		}
+		buf, ok := bufferPools[class].Get().(*buffer)
+		if !ok {
+			buf = &buffer{b: directio.AlignedBlock(csize), class: class}
+		}
+		buf.b = buf.b[:size]
+		return buf
+	}
+	return &buffer{b: directio.AlignedBlock(size), class: -1}
+}
+
+// Return the buffer to its pool. The buffer must not be used afterwards.
+func (buf *buffer) release() {
+	if buf.class < 0 {
+		return
+	}
+	buf.b = buf.b[:cap(buf.b)]
+	bufferPools[buf.class].Put(buf)
+}
+
+// Allocate a buffer suitable for direct I/O. Reads and writes of aligned buffers, with a length that is a multiple
+// of the block size, go straight to the device without copying.
+func AlignedBuffer(size int) []byte {
+	return directio.AlignedBlock(size)
+}
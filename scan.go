@@ -0,0 +1,208 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"runtime"
+	"sync"
+)
+
+const (
+	SCAN_BUFFERS = 4 // Batches in flight during a metadata scan
+)
+
+// A batch of extent metadata moving through the scan pipeline.
+type scanBatch struct {
+	offset  uint
+	size    uint
+	abuf    []byte
+	eb      []ExtentMetadata
+	dirty   map[uint]ExtentMetadata
+	matches []uint
+	err     error
+	wg      sync.WaitGroup
+}
+
+// Scan the metadata of all allocated extents. Reads are pipelined with decoding, which is spread across workers
+// by extent range. The filter runs concurrently for each decoded entry; entries passing it are handed to fn
+// serially and in device order, along with their position in the device. Extents allocated after the scan
+// starts are not included.
+func (dc *DeviceContext) ScanExtents(filter func(e *ExtentMetadata) bool, fn func(e *ExtentMetadata, epos uint)) error {
+	remaining := dc.allocatedExtents()
+	if remaining == 0 {
+		return nil
+	}
+	batchSize := min(remaining, EXTENT_BATCH)
+	free := make(chan *scanBatch, SCAN_BUFFERS)
+	for i := 0; i < SCAN_BUFFERS; i++ {
+		buf := getBuffer(int(divRoundUp(batchSize*SIZEOF_EXTENT_METADATA, BLOCK_SIZE) * BLOCK_SIZE))
+		defer buf.release()
+		free <- &scanBatch{
+			abuf: buf.b,
+			eb:   make([]ExtentMetadata, batchSize),
+		}
+	}
+	pending := make(chan *scanBatch)
+	ordered := make(chan *scanBatch, SCAN_BUFFERS)
+	quit := make(chan struct{})
+
+	// Read batches in order
+	go func() {
+		defer close(ordered)
+		defer close(pending)
+		for offset := uint(0); offset < remaining; offset += EXTENT_BATCH {
+			var b *scanBatch
+			select {
+			case <-quit:
+				return
+			case b = <-free:
+			}
+			b.offset = offset
+			b.size = min(remaining-offset, EXTENT_BATCH)
+			b.err = dc.readExtentBatch(b)
+			b.wg.Add(1)
+			ordered <- b
+			pending <- b
+		}
+	}()
+
+	// Decode and filter batches in parallel
+	for i := 0; i < min(runtime.NumCPU(), SCAN_BUFFERS); i++ {
+		go func() {
+			for b := range pending {
+				if b.err == nil {
+					decodeExtentBatch(b, filter)
+				}
+				b.wg.Done()
+			}
+		}()
+	}
+
+	// Collect results in order
+	var err error
+	for b := range ordered {
+		b.wg.Wait()
+		if err == nil && b.err != nil {
+			err = b.err
+			close(quit)
+		}
+		if err == nil {
+			for _, i := range b.matches {
+				fn(&b.eb[i], b.offset+i)
+			}
+		}
+		free <- b
+	}
+	return err
+}
+
+// Update the metadata of all allocated extents in a single pass. update is called serially and in device order
+// for every entry passing the filter and returns whether it changed the entry; each batch with changes is
+// written back with a single I/O. Batches are read, updated and written holding the metadata lock, so volumes
+// can be used meanwhile, as long as they do not touch the entries being updated.
+func (dc *DeviceContext) UpdateExtents(filter func(e *ExtentMetadata) bool, update func(e *ExtentMetadata, epos uint) bool) error {
+	remaining := dc.allocatedExtents()
+	if remaining == 0 {
+		return nil
+	}
+	batchSize := min(remaining, EXTENT_BATCH)
+	buf := getBuffer(int(divRoundUp(batchSize*SIZEOF_EXTENT_METADATA, BLOCK_SIZE) * BLOCK_SIZE))
+	defer buf.release()
+	b := &scanBatch{
+		abuf: buf.b,
+		eb:   make([]ExtentMetadata, batchSize),
+	}
+	for offset := uint(0); offset < remaining; offset += EXTENT_BATCH {
+		b.offset = offset
+		b.size = min(remaining-offset, EXTENT_BATCH)
+		if err := dc.updateExtentBatch(b, filter, update); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (dc *DeviceContext) updateExtentBatch(b *scanBatch, filter func(e *ExtentMetadata) bool, update func(e *ExtentMetadata, epos uint) bool) error {
+	dc.metadataLock.Lock()
+	defer dc.metadataLock.Unlock()
+	if err := dc.loadExtentBatch(b); err != nil {
+		return err
+	}
+	decodeExtentBatch(b, filter)
+	changed := false
+	for _, i := range b.matches {
+		e := &b.eb[i]
+		if !update(e, b.offset+i) {
+			continue
+		}
+		changed = true
+		e.encode(b.abuf[i*SIZEOF_EXTENT_METADATA:])
+		// Pending updates would overwrite the change when flushed
+		if _, ok := b.dirty[b.offset+i]; ok {
+			dc.dirtyExtents[b.offset+i] = *e
+		}
+	}
+	if !changed {
+		return nil
+	}
+	length := divRoundUp(b.size*SIZEOF_EXTENT_METADATA, BLOCK_SIZE) * BLOCK_SIZE
+	dc.metrics.metadataWrites.Add(1)
+	if _, err := dc.writeMetadataAt(b.abuf[:length], uint64(dc.extentOffset+(b.offset*SIZEOF_EXTENT_METADATA))); err != nil {
+		return fmt.Errorf("failed to write extent metadata: %w", err)
+	}
+	return nil
+}
+
+// Read the raw metadata of a batch, along with any pending updates in its range.
+func (dc *DeviceContext) readExtentBatch(b *scanBatch) error {
+	dc.metadataLock.Lock()
+	defer dc.metadataLock.Unlock()
+	return dc.loadExtentBatch(b)
+}
+
+// Same as readExtentBatch, but must be called with the metadata lock held.
+func (dc *DeviceContext) loadExtentBatch(b *scanBatch) error {
+	// Batches start at multiples of EXTENT_BATCH, so reads are always block aligned
+	length := divRoundUp(b.size*SIZEOF_EXTENT_METADATA, BLOCK_SIZE) * BLOCK_SIZE
+	if _, err := dc.readMetadataAt(b.abuf[:length], uint64(dc.extentOffset+(b.offset*SIZEOF_EXTENT_METADATA))); err != nil {
+		return fmt.Errorf("failed to read extent metadata: %w", err)
+	}
+	clear(b.dirty)
+	for i, e := range dc.dirtyExtents {
+		if i >= b.offset && i < b.offset+b.size {
+			if b.dirty == nil {
+				b.dirty = make(map[uint]ExtentMetadata)
+			}
+			b.dirty[i] = e
+		}
+	}
+	return nil
+}
+
+// Decode the metadata of a batch and collect the indices of entries passing the filter.
+func decodeExtentBatch(b *scanBatch, filter func(e *ExtentMetadata) bool) {
+	eb := b.eb[:b.size]
+	decodeExtents(eb, b.abuf)
+	for i, e := range b.dirty {
+		eb[i-b.offset] = e
+	}
+	b.matches = b.matches[:0]
+	for i := range eb {
+		if filter(&eb[i]) {
+			b.matches = append(b.matches, uint(i))
+		}
+	}
+}
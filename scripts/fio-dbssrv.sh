@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Run fio against a volume served by dbssrv. Needs fio built with the NBD engine (libnbd).
+#
+# Usage: scripts/fio-dbssrv.sh DEVICE [JOB_FILE]
+#
+# A missing DEVICE is created as a sparse file of DEVICE_SIZE and initialized; an existing one is used as is.
+# The "fio" volume is created if needed. Settings come from the environment:
+#   DEVICE_SIZE (4G), VOLUME_SIZE (1G), RUNTIME (30s), PORT (10809), DBSSRV_OPTS (e.g. "-e uring -c 1GiB")
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 DEVICE [JOB_FILE]" >&2
+	exit 1
+fi
+DEVICE=$1
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+JOB_FILE=${2:-$ROOT/scripts/dbssrv.fio}
+DEVICE_SIZE=${DEVICE_SIZE:-4G}
+VOLUME_SIZE=${VOLUME_SIZE:-1G}
+PORT=${PORT:-10809}
+
+BIN=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$BIN"' EXIT
+(cd "$ROOT" && go build -o "$BIN" ./cmd/dbsctl ./cmd/dbssrv)
+
+if [ ! -e "$DEVICE" ]; then
+	truncate -s "$DEVICE_SIZE" "$DEVICE"
+	"$BIN/dbsctl" "$DEVICE" init_device
+fi
+if ! "$BIN/dbsctl" "$DEVICE" get_volume_info | grep -qw fio; then
+	"$BIN/dbsctl" "$DEVICE" create_volume fio "$VOLUME_SIZE"
+fi
+
+# shellcheck disable=SC2086
+"$BIN/dbssrv" -u "localhost:$PORT" $DBSSRV_OPTS "$DEVICE" fio &
+SERVER=$!
+sleep 1
+
+NBD_URI="nbd://localhost:$PORT/fio" RUNTIME=${RUNTIME:-30s} fio "$JOB_FILE"
@@ -0,0 +1,583 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"bufio"
+	"compress/gzip"
+	"fmt"
+	"hash/fnv"
+	"io"
+	"math"
+
+	"github.com/kelindar/bitmap"
+)
+
+// Snapshot streams start with a header, followed by a record for each mapped extent in volume order and an end
+// marker. Records hold the extent index, the block bitmap and the data of the blocks set in it. Everything after
+// the header may be gzip compressed. Incremental streams only carry extents changed since a base snapshot, with
+// their full bitmaps, so blocks missing from a record read as zeros. They identify their base by its creation
+// time and a checksum of its block bitmaps, as imported snapshots keep the creation time of the exported ones.
+// Streams can only be imported into devices of the same geometry.
+const (
+	STREAM_MAGIC   = "DBS>STR!"
+	STREAM_VERSION = 1
+
+	STREAM_COMPRESSED  = 1 << 0
+	STREAM_INCREMENTAL = 1 << 1
+
+	STREAM_BATCH   = 16 // Extents read or written with a single submission
+	STREAM_BUFFERS = 2  // Batches in flight, so that device I/O overlaps with stream I/O
+
+	SIZEOF_STREAM_HEADER = 8 + 4 + 4 + 8 + 4 + 4 + 8 + 8 + 8
+	SIZEOF_STREAM_RECORD = 4 + EXTENT_BITMAP_SIZE
+
+	streamEnd = math.MaxUint32 // Extent index of the end marker
+)
+
+type streamHeader struct {
+	Magic         [8]byte
+	Version       uint32
+	Flags         uint32
+	VolumeSize    uint64
+	BlockSize     uint32
+	ExtentSize    uint32
+	CreatedAt     int64 // Of the exported snapshot
+	BaseCreatedAt int64 // Of the base snapshot, for incremental streams
+	BaseChecksum  uint64
+}
+
+func (h *streamHeader) encode(b []byte) {
+	_ = b[SIZEOF_STREAM_HEADER-1]
+	copy(b[0:8], h.Magic[:])
+	le.PutUint32(b[8:], h.Version)
+	le.PutUint32(b[12:], h.Flags)
+	le.PutUint64(b[16:], h.VolumeSize)
+	le.PutUint32(b[24:], h.BlockSize)
+	le.PutUint32(b[28:], h.ExtentSize)
+	le.PutUint64(b[32:], uint64(h.CreatedAt))
+	le.PutUint64(b[40:], uint64(h.BaseCreatedAt))
+	le.PutUint64(b[48:], h.BaseChecksum)
+}
+
+func (h *streamHeader) decode(b []byte) {
+	_ = b[SIZEOF_STREAM_HEADER-1]
+	copy(h.Magic[:], b[0:8])
+	h.Version = le.Uint32(b[8:])
+	h.Flags = le.Uint32(b[12:])
+	h.VolumeSize = le.Uint64(b[16:])
+	h.BlockSize = le.Uint32(b[24:])
+	h.ExtentSize = le.Uint32(b[28:])
+	h.CreatedAt = int64(le.Uint64(b[32:]))
+	h.BaseCreatedAt = int64(le.Uint64(b[40:]))
+	h.BaseChecksum = le.Uint64(b[48:])
+}
+
+// Checksum the block bitmaps of the extents of a map that have any blocks.
+func bitmapChecksum(em *ExtentMap) uint64 {
+	h := fnv.New64a()
+	var ebuf [4]byte
+	em.forEach(func(eidx uint32, e *ExtentMetadata) error {
+		if bitmap.FromBytes(e.BlockBitmap[:]).Count() > 0 {
+			le.PutUint32(ebuf[:], eidx)
+			h.Write(ebuf[:])
+			h.Write(e.BlockBitmap[:])
+		}
+		return nil
+	})
+	return h.Sum64()
+}
+
+// Extents moving between the device and a stream. Data buffers hold whole extents, with only the blocks set in
+// the bitmap filled in.
+type streamBatch struct {
+	eidxs   []uint32
+	extents []ExtentMetadata
+	bufs    []*buffer
+	err     error
+}
+
+func newStreamBatches(extentSize uint) chan *streamBatch {
+	free := make(chan *streamBatch, STREAM_BUFFERS)
+	for i := 0; i < STREAM_BUFFERS; i++ {
+		b := &streamBatch{bufs: make([]*buffer, STREAM_BATCH)}
+		for j := range b.bufs {
+			b.bufs[j] = getBuffer(int(extentSize))
+		}
+		free <- b
+	}
+	return free
+}
+
+func releaseStreamBatches(free chan *streamBatch) {
+	for i := 0; i < STREAM_BUFFERS; i++ {
+		for _, buf := range (<-free).bufs {
+			buf.release()
+		}
+	}
+}
+
+// Call fn for each run of consecutive blocks set in an extent bitmap.
+func (dc *DeviceContext) forEachBlockRun(bb bitmap.Bitmap, fn func(first uint, end uint) error) error {
+	for i := uint(0); i < dc.blocksInExtent; {
+		if !bb.Contains(uint32(i)) {
+			i++
+			continue
+		}
+		j := i + 1
+		for j < dc.blocksInExtent && bb.Contains(uint32(j)) {
+			j++
+		}
+		if err := fn(i, j); err != nil {
+			return err
+		}
+		i = j
+	}
+	return nil
+}
+
+// Write a snapshot to a stream. With a non-zero base, which must be an ancestor, only the extents changed since
+// the base are included and the stream can only be imported over a copy of the base. Extent data is read in
+// batches, with all block runs of a batch submitted at once. The device handle is only held while reading each
+// batch, not while writing to the stream; if a management operation runs in between, the extents are mapped
+// again. If the snapshot is the current snapshot of an open volume, concurrent writes may or may not be included.
+func (d *Device) ExportSnapshot(w io.Writer, snapshotId uint, baseSnapshotId uint, compress bool) error {
+	dc := d.dc
+	d.lock.RLock()
+	generation := d.generation
+	v, em, baseMap, err := getDiffExtentMaps(dc, snapshotId, baseSnapshotId)
+	var createdAt, baseCreatedAt int64
+	if err == nil {
+		createdAt = dc.snapshots[snapshotId-1].CreatedAt
+		if baseSnapshotId != 0 {
+			baseCreatedAt = dc.snapshots[baseSnapshotId-1].CreatedAt
+		}
+	}
+	d.lock.RUnlock()
+	if err != nil {
+		return err
+	}
+	var eidxs []uint32
+	em.forEach(func(eidx uint32, e *ExtentMetadata) error {
+		// Empty extents only matter as masks over the base
+		if baseSnapshotId != 0 || bitmap.FromBytes(e.BlockBitmap[:]).Count() > 0 {
+			eidxs = append(eidxs, eidx)
+		}
+		return nil
+	})
+
+	bw := bufio.NewWriterSize(w, EXTENT_SIZE)
+	hdr := streamHeader{
+		Version:    STREAM_VERSION,
+		VolumeSize: v.VolumeSize,
+		BlockSize:  uint32(dc.blockSize),
+		ExtentSize: uint32(dc.extentSize),
+		CreatedAt:  createdAt,
+	}
+	copy(hdr.Magic[:], STREAM_MAGIC)
+	if compress {
+		hdr.Flags |= STREAM_COMPRESSED
+	}
+	if baseSnapshotId != 0 {
+		hdr.Flags |= STREAM_INCREMENTAL
+		hdr.BaseCreatedAt = baseCreatedAt
+		hdr.BaseChecksum = bitmapChecksum(baseMap)
+	}
+	hbuf := make([]byte, SIZEOF_STREAM_HEADER)
+	hdr.encode(hbuf)
+	if _, err := bw.Write(hbuf); err != nil {
+		return err
+	}
+	var sw io.Writer = bw
+	var zw *gzip.Writer
+	if compress {
+		zw, _ = gzip.NewWriterLevel(bw, gzip.BestSpeed)
+		sw = zw
+	}
+
+	// Read batches in the background
+	free := newStreamBatches(dc.extentSize)
+	ready := make(chan *streamBatch, STREAM_BUFFERS)
+	quit := make(chan struct{})
+	go func() {
+		defer close(ready)
+		for start := 0; start < len(eidxs); start += STREAM_BATCH {
+			var b *streamBatch
+			select {
+			case <-quit:
+				return
+			case b = <-free:
+			}
+			b.eidxs = eidxs[start:min(start+STREAM_BATCH, len(eidxs))]
+			b.err = d.readExportBatch(b, &em, &generation, snapshotId, baseSnapshotId)
+			ready <- b
+		}
+	}()
+
+	rbuf := make([]byte, SIZEOF_STREAM_RECORD)
+	for b := range ready {
+		if err == nil {
+			if err = b.err; err == nil {
+				err = dc.writeStreamBatch(sw, b, rbuf)
+			}
+			if err != nil {
+				close(quit)
+			}
+		}
+		free <- b
+	}
+	releaseStreamBatches(free)
+	if err != nil {
+		return err
+	}
+	le.PutUint32(rbuf[0:], streamEnd)
+	clear(rbuf[4:])
+	if _, err := sw.Write(rbuf); err != nil {
+		return err
+	}
+	if zw != nil {
+		if err := zw.Close(); err != nil {
+			return err
+		}
+	}
+	return bw.Flush()
+}
+
+// Read the data of a batch of exported extents, mapping them again if the device changed since they were mapped.
+func (d *Device) readExportBatch(b *streamBatch, em **ExtentMap, generation *uint64, snapshotId uint, baseSnapshotId uint) error {
+	d.lock.RLock()
+	defer d.lock.RUnlock()
+	dc := d.dc
+	if d.generation != *generation {
+		_, nem, _, err := getDiffExtentMaps(dc, snapshotId, baseSnapshotId)
+		if err != nil {
+			return fmt.Errorf("snapshot changed during export: %w", err)
+		}
+		*em, *generation = nem, d.generation
+	}
+	b.extents = b.extents[:0]
+	var reqs []*IORequest
+	for i, eidx := range b.eidxs {
+		e := (*em).lookup(eidx)
+		if e == nil || e.SnapshotId == 0 {
+			return fmt.Errorf("snapshot changed during export")
+		}
+		b.extents = append(b.extents, *e)
+		dc.forEachBlockRun(bitmap.FromBytes(e.BlockBitmap[:]), func(first uint, end uint) error {
+			reqs = append(reqs, &IORequest{
+				Data:   b.bufs[i].b[first*dc.blockSize : end*dc.blockSize],
+				Offset: dc.blockDataOffset(uint(e.ExtentPos), first),
+			})
+			return nil
+		})
+	}
+	return dc.SubmitBlocksData(reqs...)
+}
+
+func (dc *DeviceContext) writeStreamBatch(sw io.Writer, b *streamBatch, rbuf []byte) error {
+	for i, eidx := range b.eidxs {
+		e := &b.extents[i]
+		le.PutUint32(rbuf[0:], eidx)
+		copy(rbuf[4:], e.BlockBitmap[:])
+		if _, err := sw.Write(rbuf); err != nil {
+			return err
+		}
+		err := dc.forEachBlockRun(bitmap.FromBytes(e.BlockBitmap[:]), func(first uint, end uint) error {
+			_, err := sw.Write(b.bufs[i].b[first*dc.blockSize : end*dc.blockSize])
+			return err
+		})
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Import a stream written by ExportSnapshot. A full stream creates a new volume. An incremental stream is
+// applied to an existing volume whose current snapshot is a copy of the base, checked by its creation time and
+// block bitmaps, in a new snapshot on top of it. Extents are written in batches: data first, with all block runs
+// of a batch submitted at once, then metadata, with a single write for each run of consecutive extents. The new
+// snapshot is only attached to the volume at the end, so the stream is read without holding the device and the
+// volume is not visible while being imported. A failed import purges the snapshot, leaving the device as it was.
+func (d *Device) ImportVolume(r io.Reader, volumeName string) error {
+	br := bufio.NewReaderSize(r, EXTENT_SIZE)
+	hbuf := make([]byte, SIZEOF_STREAM_HEADER)
+	if _, err := io.ReadFull(br, hbuf); err != nil {
+		return fmt.Errorf("failed to read stream header: %w", err)
+	}
+	var hdr streamHeader
+	hdr.decode(hbuf)
+	if string(hdr.Magic[:]) != STREAM_MAGIC {
+		return fmt.Errorf("not a snapshot stream")
+	}
+	if hdr.Version != STREAM_VERSION {
+		return fmt.Errorf("unsupported stream version %v", hdr.Version)
+	}
+	g, err := Geometry{BlockSize: uint(hdr.BlockSize), ExtentSize: uint(hdr.ExtentSize)}.normalize()
+	if err != nil {
+		return fmt.Errorf("invalid stream geometry: %w", err)
+	}
+	if g != d.Geometry() {
+		return fmt.Errorf("stream geometry does not match the device")
+	}
+	var sr io.Reader = br
+	var zr *gzip.Reader
+	if hdr.Flags&STREAM_COMPRESSED != 0 {
+		var err error
+		if zr, err = gzip.NewReader(br); err != nil {
+			return fmt.Errorf("failed to read stream: %w", err)
+		}
+		defer zr.Close()
+		sr = zr
+	}
+
+	dc := d.dc
+	incremental := hdr.Flags&STREAM_INCREMENTAL != 0
+	if !incremental && hdr.VolumeSize/uint64(dc.extentSize) == 0 {
+		return fmt.Errorf("volume with zero size")
+	}
+	// Check the target, at the start and again when attaching the snapshot
+	check := func(parentSnapshotId uint16) (*VolumeMetadata, error) {
+		v := dc.FindVolume(volumeName)
+		if !incremental {
+			if v != nil {
+				return nil, fmt.Errorf("volume %v already exists", volumeName)
+			}
+			return nil, nil
+		}
+		if v == nil {
+			return nil, fmt.Errorf("volume %v not found", volumeName)
+		}
+		if _, ok := d.volumes[v]; ok {
+			return nil, fmt.Errorf("volume %v is open", volumeName)
+		}
+		if v.VolumeSize != hdr.VolumeSize {
+			return nil, fmt.Errorf("volume %v does not match the size of the stream", volumeName)
+		}
+		if parentSnapshotId != 0 {
+			if v.SnapshotId != parentSnapshotId {
+				return nil, fmt.Errorf("volume %v changed during import", volumeName)
+			}
+			return v, nil
+		}
+		if dc.snapshots[v.SnapshotId-1].CreatedAt != hdr.BaseCreatedAt {
+			return nil, fmt.Errorf("volume %v does not hold the base snapshot of the stream", volumeName)
+		}
+		vem, err := GetVolumeExtentMap(dc, v.VolumeSize, v.SnapshotId)
+		if err != nil {
+			return nil, err
+		}
+		if bitmapChecksum(vem) != hdr.BaseChecksum {
+			return nil, fmt.Errorf("volume %v does not hold the base snapshot of the stream", volumeName)
+		}
+		return v, nil
+	}
+	d.lock.Lock()
+	v, err := check(0)
+	var parentSnapshotId, sid uint16
+	if err == nil {
+		if v != nil {
+			parentSnapshotId = v.SnapshotId
+		}
+		if sid, err = dc.AddSnapshot(parentSnapshotId); err == nil {
+			// Keep the identity of the exported snapshot, so that streams based on it can be applied later
+			dc.SetSnapshotCreatedAt(sid, hdr.CreatedAt)
+			if err = dc.WriteMetadata(); err != nil {
+				dc.RemoveSnapshot(sid)
+			}
+		}
+	}
+	d.lock.Unlock()
+	if err != nil {
+		return err
+	}
+
+	// Attach the snapshot, or put everything back as it was
+	attach := func() error {
+		d.lock.Lock()
+		defer d.lock.Unlock()
+		v, err := check(parentSnapshotId)
+		if err != nil {
+			return err
+		}
+		if incremental {
+			dc.SetVolumeSnapshot(v, sid)
+		} else if v, err = dc.AttachVolume(volumeName, hdr.VolumeSize, sid); err != nil {
+			return err
+		}
+		if err := d.commit(); err != nil {
+			if incremental {
+				dc.SetVolumeSnapshot(v, parentSnapshotId)
+			} else {
+				dc.RemoveVolume(v)
+			}
+			return err
+		}
+		return nil
+	}
+	err = d.importSnapshot(sr, zr, sid, uint(hdr.VolumeSize/uint64(dc.extentSize)))
+	if err == nil {
+		err = attach()
+	}
+	if err != nil {
+		// If the purge fails as well, the snapshot is purged when the device is next opened
+		d.purgeSnapshots([]uint16{sid})
+		return err
+	}
+	return nil
+}
+
+// Write the extents of a stream to a new snapshot.
+func (d *Device) importSnapshot(sr io.Reader, zr *gzip.Reader, sid uint16, totalVolumeExtents uint) error {
+	dc := d.dc
+	// Write batches in the background, holding the device like volume I/O does
+	free := newStreamBatches(dc.extentSize)
+	ready := make(chan *streamBatch, STREAM_BUFFERS)
+	stop := make(chan struct{})
+	done := make(chan error, 1)
+	go func() {
+		var err error
+		hint := uint32(NO_HINT)
+		for b := range ready {
+			if err == nil {
+				d.lock.RLock()
+				err = dc.importExtentBatch(b, sid, &hint)
+				d.lock.RUnlock()
+				if err != nil {
+					close(stop)
+				}
+			}
+			free <- b
+		}
+		done <- err
+	}()
+
+	err := dc.readStreamBatches(sr, totalVolumeExtents, free, ready, stop)
+	if err == nil && zr != nil {
+		// The checksum is only verified at the end of the compressed stream
+		if _, cerr := io.Copy(io.Discard, zr); cerr != nil {
+			err = fmt.Errorf("failed to read stream: %w", cerr)
+		}
+	}
+	close(ready)
+	// The write error, if any, is the one that stopped the reader
+	if werr := <-done; werr != nil {
+		err = werr
+	}
+	releaseStreamBatches(free)
+	return err
+}
+
+// Parse extent records into batches, up to the end marker or until stopped, which returns errStopped.
+func (dc *DeviceContext) readStreamBatches(sr io.Reader, totalVolumeExtents uint, free chan *streamBatch, ready chan *streamBatch, stop chan struct{}) error {
+	rbuf := make([]byte, SIZEOF_STREAM_RECORD)
+	next := uint(0)
+	for {
+		var b *streamBatch
+		select {
+		case <-stop:
+			return errStopped
+		case b = <-free:
+		}
+		b.eidxs = b.eidxs[:0]
+		b.extents = b.extents[:0]
+		for len(b.eidxs) < STREAM_BATCH {
+			if _, err := io.ReadFull(sr, rbuf); err != nil {
+				free <- b
+				return fmt.Errorf("failed to read stream: %w", err)
+			}
+			eidx := le.Uint32(rbuf[0:])
+			if eidx == streamEnd {
+				ready <- b
+				return nil
+			}
+			if uint(eidx) < next || uint(eidx) >= totalVolumeExtents {
+				free <- b
+				return fmt.Errorf("invalid extent %v in stream", eidx)
+			}
+			next = uint(eidx) + 1
+			var e ExtentMetadata
+			e.ExtentPos = eidx
+			copy(e.BlockBitmap[:], rbuf[4:])
+			buf := b.bufs[len(b.eidxs)].b
+			err := dc.forEachBlockRun(bitmap.FromBytes(e.BlockBitmap[:]), func(first uint, end uint) error {
+				_, err := io.ReadFull(sr, buf[first*dc.blockSize:end*dc.blockSize])
+				return err
+			})
+			if err != nil {
+				free <- b
+				return fmt.Errorf("failed to read stream: %w", err)
+			}
+			b.eidxs = append(b.eidxs, eidx)
+			b.extents = append(b.extents, e)
+		}
+		ready <- b
+	}
+}
+
+// Allocate and write a batch of imported extents for a snapshot. Metadata is written after data, so that a crash
+// never leaves extents recorded without their contents.
+func (dc *DeviceContext) importExtentBatch(b *streamBatch, snapshotId uint16, hint *uint32) error {
+	eposs := make([]uint, 0, len(b.extents))
+	var reqs []*IORequest
+	for i := range b.extents {
+		epos, err := dc.AllocateExtent(*hint)
+		if err != nil {
+			// Extents without entries are not found by a purge
+			dc.releaseClearedExtents(eposs)
+			return err
+		}
+		*hint = epos + 1
+		eposs = append(eposs, uint(epos))
+		e := &b.extents[i]
+		e.SnapshotId = snapshotId
+		buf := b.bufs[i].b
+		dc.forEachBlockRun(bitmap.FromBytes(e.BlockBitmap[:]), func(first uint, end uint) error {
+			reqs = append(reqs, &IORequest{
+				Data:   buf[first*dc.blockSize : end*dc.blockSize],
+				Offset: dc.blockDataOffset(uint(epos), first),
+				Write:  true,
+			})
+			return nil
+		})
+	}
+	if err := dc.SubmitBlocksData(reqs...); err != nil {
+		dc.releaseClearedExtents(eposs)
+		return err
+	}
+	for start := 0; start < len(eposs); {
+		end := start + 1
+		for end < len(eposs) && eposs[end] == eposs[end-1]+1 {
+			end++
+		}
+		if err := dc.WriteExtents(b.extents[start:end], eposs[start]); err != nil {
+			return err
+		}
+		start = end
+	}
+	return nil
+}
+
+func ExportSnapshot(device string, w io.Writer, snapshotId uint, baseSnapshotId uint, compress bool) error {
+	return withDevice(device, func(d *Device) error {
+		return d.ExportSnapshot(w, snapshotId, baseSnapshotId, compress)
+	})
+}
+
+func ImportVolume(device string, r io.Reader, volumeName string) error {
+	return withDevice(device, func(d *Device) error {
+		return d.ImportVolume(r, volumeName)
+	})
+}
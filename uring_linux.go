@@ -0,0 +1,343 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"math"
+	"os"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+// Minimal io_uring binding using raw system calls (kernel 5.6 or later).
+const (
+	URING_ENTRIES = 256 // Submission queue size, which also bounds requests in flight
+
+	SYS_IO_URING_SETUP    = 425
+	SYS_IO_URING_ENTER    = 426
+	SYS_IO_URING_REGISTER = 427
+
+	IORING_OFF_SQ_RING = 0
+	IORING_OFF_CQ_RING = 0x8000000
+	IORING_OFF_SQES    = 0x10000000
+
+	IORING_OP_NOP   = 0
+	IORING_OP_READ  = 22
+	IORING_OP_WRITE = 23
+
+	IORING_ENTER_GETEVENTS  = 1 << 0
+	IORING_REGISTER_FILES   = 2
+	IOSQE_FIXED_FILE        = 1 << 0
+	IORING_SQE_SIZE         = 64
+	IORING_CQE_SIZE         = 16
+	IORING_STOP_USER_DATA   = math.MaxUint64
+	IORING_PARAMS_SIZE      = 120
+	IORING_SQ_OFFSETS_START = 40
+	IORING_CQ_OFFSETS_START = 80
+)
+
+type uring struct {
+	fd      int
+	fixed   bool // The device file is registered at index 0
+	filefd  int
+	sqRing  []byte
+	cqRing  []byte
+	sqes    []byte
+	sqHead  *uint32
+	sqTail  *uint32
+	sqMask  uint32
+	sqArray []uint32
+	cqHead  *uint32
+	cqTail  *uint32
+	cqMask  uint32
+	cqesOff uint32
+	sqLock  sync.Mutex // Serializes submissions
+	pending uint32     // Entries queued but not yet submitted
+	slots   []atomic.Pointer[IORequest]
+	free    chan uint32 // Free request slots
+	stopped chan struct{}
+	dead    chan struct{} // Closed if the ring fails, after which no requests are accepted
+	err     error         // Why the ring failed, set before closing dead
+}
+
+func ringUint32(b []byte, off uint32) *uint32 {
+	return (*uint32)(unsafe.Pointer(&b[off]))
+}
+
+func newURing(filefd int) (*uring, error) {
+	var params [IORING_PARAMS_SIZE]byte
+	fd, _, errno := syscall.Syscall(SYS_IO_URING_SETUP, URING_ENTRIES, uintptr(unsafe.Pointer(&params[0])), 0)
+	if errno != 0 {
+		return nil, fmt.Errorf("cannot set up io_uring: %w", errno)
+	}
+	r := &uring{
+		fd:      int(fd),
+		filefd:  filefd,
+		stopped: make(chan struct{}),
+		dead:    make(chan struct{}),
+	}
+	p := func(off uint32) uint32 { return le.Uint32(params[off:]) }
+	sqEntries, cqEntries := p(0), p(4)
+	sqOff := func(i uint32) uint32 { return p(IORING_SQ_OFFSETS_START + 4*i) }
+	cqOff := func(i uint32) uint32 { return p(IORING_CQ_OFFSETS_START + 4*i) }
+
+	var err error
+	if r.sqRing, err = syscall.Mmap(r.fd, IORING_OFF_SQ_RING, int(sqOff(6)+sqEntries*4), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED|syscall.MAP_POPULATE); err != nil {
+		r.close()
+		return nil, fmt.Errorf("cannot map io_uring: %w", err)
+	}
+	if r.cqRing, err = syscall.Mmap(r.fd, IORING_OFF_CQ_RING, int(cqOff(5)+cqEntries*IORING_CQE_SIZE), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED|syscall.MAP_POPULATE); err != nil {
+		r.close()
+		return nil, fmt.Errorf("cannot map io_uring: %w", err)
+	}
+	if r.sqes, err = syscall.Mmap(r.fd, IORING_OFF_SQES, int(sqEntries*IORING_SQE_SIZE), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED|syscall.MAP_POPULATE); err != nil {
+		r.close()
+		return nil, fmt.Errorf("cannot map io_uring: %w", err)
+	}
+	r.sqHead, r.sqTail = ringUint32(r.sqRing, sqOff(0)), ringUint32(r.sqRing, sqOff(1))
+	r.sqMask = *ringUint32(r.sqRing, sqOff(2))
+	r.sqArray = unsafe.Slice(ringUint32(r.sqRing, sqOff(6)), sqEntries)
+	r.cqHead, r.cqTail = ringUint32(r.cqRing, cqOff(0)), ringUint32(r.cqRing, cqOff(1))
+	r.cqMask = *ringUint32(r.cqRing, cqOff(2))
+	r.cqesOff = cqOff(5)
+
+	// Register the device file, so that the kernel does not look it up on every request
+	fds := [1]int32{int32(filefd)}
+	if _, _, errno := syscall.Syscall6(SYS_IO_URING_REGISTER, uintptr(r.fd), IORING_REGISTER_FILES, uintptr(unsafe.Pointer(&fds[0])), 1, 0, 0); errno == 0 {
+		r.fixed = true
+	}
+
+	// The completion queue is at least as large as the submission queue, so it never overflows
+	r.slots = make([]atomic.Pointer[IORequest], sqEntries)
+	r.free = make(chan uint32, sqEntries)
+	for i := uint32(0); i < sqEntries; i++ {
+		r.free <- i
+	}
+	go r.reap()
+	return r, nil
+}
+
+func (r *uring) enter(toSubmit uint32, minComplete uint32, flags uint32) (uint32, error) {
+	for {
+		n, _, errno := syscall.Syscall6(SYS_IO_URING_ENTER, uintptr(r.fd), uintptr(toSubmit), uintptr(minComplete), uintptr(flags), 0, 0)
+		if errno == syscall.EINTR || errno == syscall.EAGAIN || errno == syscall.EBUSY {
+			continue
+		}
+		if errno != 0 {
+			return 0, errno
+		}
+		return uint32(n), nil
+	}
+}
+
+// Fill in the next submission queue entry. Must be called with the submission lock held.
+func (r *uring) queue(opcode uint8, req *IORequest, userData uint64) {
+	tail := atomic.LoadUint32(r.sqTail)
+	idx := tail & r.sqMask
+	sqe := r.sqes[idx*IORING_SQE_SIZE : (idx+1)*IORING_SQE_SIZE]
+	clear(sqe)
+	sqe[0] = opcode
+	if req != nil {
+		if r.fixed {
+			sqe[1] = IOSQE_FIXED_FILE
+		} else {
+			le.PutUint32(sqe[4:], uint32(r.filefd))
+		}
+		le.PutUint64(sqe[8:], req.Offset)
+		le.PutUint64(sqe[16:], uint64(uintptr(unsafe.Pointer(&req.buf[0]))))
+		le.PutUint32(sqe[24:], uint32(len(req.buf)))
+		// Publish the request only after reading it, as it belongs to the completion loop from now on
+		r.slots[userData].Store(req)
+	}
+	le.PutUint64(sqe[32:], userData)
+	r.sqArray[idx] = idx
+	atomic.StoreUint32(r.sqTail, tail+1)
+	r.pending++
+}
+
+// Submit all queued entries. Must be called with the submission lock held.
+func (r *uring) flush() error {
+	for r.pending > 0 {
+		n, err := r.enter(r.pending, 0, 0)
+		if err != nil {
+			return fmt.Errorf("cannot submit to io_uring: %w", err)
+		}
+		r.pending -= n
+	}
+	return nil
+}
+
+// Queue requests and submit them with as few system calls as possible. If submission fails, requests already
+// submitted are waited for and the rest are completed with the error, so that no buffer is in use on return.
+func (r *uring) submit(reqs []*IORequest) error {
+	r.sqLock.Lock()
+	queued, err := r.queueAll(reqs)
+	if err != nil {
+		r.drop(err)
+	}
+	r.sqLock.Unlock()
+	if err != nil {
+		for _, req := range reqs[queued:] {
+			req.complete(0, err)
+		}
+		for _, req := range reqs[:queued] {
+			req.Wait()
+		}
+	}
+	return err
+}
+
+// Queue and submit requests. Returns how many were queued. Must be called with the submission lock held.
+func (r *uring) queueAll(reqs []*IORequest) (int, error) {
+	select {
+	case <-r.dead:
+		return 0, r.err
+	default:
+	}
+	for i, req := range reqs {
+		if len(req.buf) == 0 {
+			req.complete(0, nil)
+			continue
+		}
+		var slot uint32
+		select {
+		case slot = <-r.free:
+		default:
+			// Submit what is queued before waiting for completions
+			if err := r.flush(); err != nil {
+				return i, err
+			}
+			select {
+			case slot = <-r.free:
+			case <-r.dead:
+				return i, r.err
+			}
+		}
+		opcode := uint8(IORING_OP_READ)
+		if req.Write {
+			opcode = IORING_OP_WRITE
+		}
+		r.queue(opcode, req, uint64(slot))
+	}
+	return len(reqs), r.flush()
+}
+
+// Take back entries not yet consumed by the kernel and complete their requests with the error. Must be called
+// with the submission lock held.
+func (r *uring) drop(err error) {
+	head := atomic.LoadUint32(r.sqHead)
+	for tail := atomic.LoadUint32(r.sqTail); tail != head; {
+		tail--
+		sqe := r.sqes[(tail&r.sqMask)*IORING_SQE_SIZE:]
+		if userData := le.Uint64(sqe[32:]); userData != IORING_STOP_USER_DATA {
+			r.release(uint32(userData), err)
+		}
+	}
+	atomic.StoreUint32(r.sqTail, head)
+	r.pending = 0
+}
+
+// Complete the request in a slot, if any, with an error and free the slot. Only for entries the kernel never saw.
+func (r *uring) release(slot uint32, err error) {
+	if req := r.slots[slot].Swap(nil); req != nil {
+		req.complete(0, err)
+		r.free <- slot
+	}
+}
+
+// Mark the ring dead and fail all requests in flight, as their completions can no longer be reaped. The kernel
+// may still be transferring to or from their buffers, so bounce buffers are leaked instead of going back to the
+// pool, where the next user could see them overwritten.
+func (r *uring) fail(err error) {
+	r.err = err
+	close(r.dead)
+	r.sqLock.Lock()
+	defer r.sqLock.Unlock()
+	for slot := range r.slots {
+		if req := r.slots[slot].Swap(nil); req != nil {
+			req.bounce = nil
+			req.complete(0, err)
+			r.free <- uint32(slot)
+		}
+	}
+}
+
+// Complete requests as their results arrive, until the ring is stopped.
+func (r *uring) reap() {
+	defer close(r.stopped)
+	for {
+		head := atomic.LoadUint32(r.cqHead)
+		tail := atomic.LoadUint32(r.cqTail)
+		if head == tail {
+			if _, err := r.enter(0, 1, IORING_ENTER_GETEVENTS); err != nil {
+				r.fail(fmt.Errorf("cannot wait for io_uring: %w", err))
+				return
+			}
+			continue
+		}
+		stop := false
+		for ; head != tail; head++ {
+			cqe := r.cqRing[r.cqesOff+(head&r.cqMask)*IORING_CQE_SIZE:]
+			userData := le.Uint64(cqe[0:])
+			res := int32(le.Uint32(cqe[8:]))
+			if userData == IORING_STOP_USER_DATA {
+				stop = true
+				continue
+			}
+			req := r.slots[userData].Swap(nil)
+			if res < 0 {
+				op := "read"
+				if req.Write {
+					op = "write"
+				}
+				req.complete(0, &os.PathError{Op: op, Path: "io_uring", Err: syscall.Errno(-res)})
+			} else {
+				req.complete(int(res), nil)
+			}
+			r.free <- uint32(userData)
+		}
+		atomic.StoreUint32(r.cqHead, head)
+		if stop {
+			return
+		}
+	}
+}
+
+// Stop the completion loop and release the ring. There must be no requests in flight.
+func (r *uring) close() {
+	if r.sqes != nil {
+		select {
+		case <-r.dead:
+			// The completion loop is gone already
+		default:
+			r.sqLock.Lock()
+			r.queue(IORING_OP_NOP, nil, IORING_STOP_USER_DATA)
+			err := r.flush()
+			r.sqLock.Unlock()
+			if err == nil {
+				<-r.stopped
+			}
+		}
+	}
+	for _, m := range [][]byte{r.sqes, r.cqRing, r.sqRing} {
+		if m != nil {
+			syscall.Munmap(m)
+		}
+	}
+	syscall.Close(r.fd)
+}
@@ -0,0 +1,169 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"time"
+
+	"github.com/kelindar/bitmap"
+)
+
+const (
+	VACUUM_BATCH = 64 // Extents relocated per vacuum step
+)
+
+// Compact the device by relocating extents from the end of the allocated area into free holes, shrinking the
+// allocated area. Work is done in steps of batch extents; each step holds the device exclusively and is written
+// out before pausing, so the vacuum can run while volumes are being served and can be interrupted at any point.
+// A later run picks up where the previous one stopped. Returns the number of extents reclaimed.
+func (d *Device) Vacuum(batch uint, pause time.Duration) (uint, error) {
+	// Extents of snapshots being purged must stay in place
+	d.purgeLock.Lock()
+	defer d.purgeLock.Unlock()
+	if err := d.releaseDuplicates(); err != nil {
+		return 0, err
+	}
+	reclaimed := uint(0)
+	for {
+		n, done, err := d.vacuumStep(batch)
+		reclaimed += n
+		if err != nil || done {
+			return reclaimed, err
+		}
+		if pause > 0 {
+			time.Sleep(pause)
+		}
+	}
+}
+
+// Release duplicate entries, which are left behind if a relocation is interrupted after writing the new entry
+// but before clearing the old one.
+func (d *Device) releaseDuplicates() error {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	d.generation++
+	dc := d.dc
+	if err := dc.loadFreeExtents(); err != nil {
+		return err
+	}
+	positions := make(map[uint64]uint)
+	var duplicates []uint
+	err := dc.ScanExtents(func(e *ExtentMetadata) bool {
+		return e.SnapshotId != 0
+	}, func(e *ExtentMetadata, epos uint) {
+		key := uint64(e.SnapshotId)<<32 | uint64(e.ExtentPos)
+		if prev, ok := positions[key]; ok {
+			// Maps are built with the last entry winning, so the earlier copy is unused
+			duplicates = append(duplicates, prev)
+		}
+		positions[key] = epos
+	})
+	if err != nil {
+		return err
+	}
+	var empty ExtentMetadata
+	for _, epos := range duplicates {
+		if err := dc.WriteExtent(&empty, epos); err != nil {
+			return err
+		}
+	}
+	return dc.Flush()
+}
+
+// Relocate up to batch extents from the tail into the lowest free extents. Returns the extents reclaimed and
+// whether there is nothing left to do. Data and new entries are made durable before any old entry is cleared or
+// the allocated area shrinks, so that a crash leaves at worst duplicate entries (see releaseDuplicates).
+func (d *Device) vacuumStep(batch uint) (uint, bool, error) {
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	d.generation++
+	dc := d.dc
+	reclaimed := uint(0)
+	done := false
+	eb := make([]ExtentMetadata, 1)
+	type move struct {
+		e          ExtentMetadata
+		esrc, edst uint
+	}
+	var moves []move
+	// Volume I/O is excluded, so the allocation count only changes here
+	allocated := dc.superblock.AllocatedDeviceExtents
+	for reclaimed < batch {
+		if allocated == 0 {
+			done = true
+			break
+		}
+		tail := allocated - 1
+		// Includes entries written by earlier moves of this step
+		if err := dc.ReadExtents(eb, uint(tail)); err != nil {
+			return reclaimed, false, err
+		}
+		if eb[0].SnapshotId != 0 {
+			hole, ok := dc.allocateBelow(tail)
+			if !ok {
+				// Released extents become free when flushed, so they are picked up by a later run
+				done = true
+				break
+			}
+			if err := dc.relocateExtent(&eb[0], uint(tail), uint(hole)); err != nil {
+				return reclaimed, false, err
+			}
+			moves = append(moves, move{eb[0], uint(tail), uint(hole)})
+		}
+		allocated = tail
+		reclaimed++
+	}
+	if len(moves) > 0 {
+		if err := dc.Sync(); err != nil {
+			return reclaimed, false, err
+		}
+	}
+	var empty ExtentMetadata
+	for _, m := range moves {
+		if err := dc.WriteExtent(&empty, m.esrc); err != nil {
+			return reclaimed, false, err
+		}
+		d.remapExtent(&m.e, m.esrc, m.edst)
+	}
+	if reclaimed > 0 {
+		dc.TrimAllocation(allocated)
+	}
+	if err := dc.Flush(); err != nil {
+		return reclaimed, false, err
+	}
+	return reclaimed, done, nil
+}
+
+// Copy an extent to another position on the device and queue its new entry. The old entry is left in place.
+func (dc *DeviceContext) relocateExtent(e *ExtentMetadata, esrc uint, edst uint) error {
+	if err := dc.CopyExtentData(esrc, edst, bitmap.FromBytes(e.BlockBitmap[:])); err != nil {
+		return err
+	}
+	return dc.WriteExtent(e, edst)
+}
+
+// Point open volumes to the new position of a relocated extent. Must be called with the device handle held
+// exclusively.
+func (d *Device) remapExtent(e *ExtentMetadata, esrc uint, edst uint) {
+	dc := d.dc
+	for _, vc := range d.volumes {
+		if !dc.HasSnapshot(vc.volume, e.SnapshotId) || uint(e.ExtentPos) >= vc.vem.totalVolumeExtents {
+			continue
+		}
+		if me := vc.vem.lookup(e.ExtentPos); me != nil && me.SnapshotId == e.SnapshotId && uint(me.ExtentPos) == esrc {
+			vc.vem.place(e.ExtentPos, e.SnapshotId, uint32(edst))
+		}
+	}
+}
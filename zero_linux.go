@@ -0,0 +1,55 @@
+// Copyright © 2024 FORTH-ICS
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package dbs
+
+import (
+	"fmt"
+	"os"
+	"syscall"
+	"unsafe"
+)
+
+const (
+	FALLOC_FL_KEEP_SIZE  = 0x01
+	FALLOC_FL_PUNCH_HOLE = 0x02
+	FALLOC_FL_ZERO_RANGE = 0x10
+
+	BLKZEROOUT = 0x127f // _IO(0x12, 127)
+)
+
+// Zero a range of a file without writing it: with BLKZEROOUT on block devices, which uses write zeroes or unmap
+// commands if the device has them, or by zeroing or punching out the range on regular files. Discard alone
+// (BLKDISCARD) is not used, as devices need not return zeros for discarded blocks.
+func zeroFile(f *os.File, offset uint64, length uint64) error {
+	info, err := f.Stat()
+	if err != nil {
+		return err
+	}
+	if info.Mode()&os.ModeDevice != 0 {
+		r := [2]uint64{offset, length}
+		if _, _, errno := syscall.Syscall(syscall.SYS_IOCTL, f.Fd(), BLKZEROOUT, uintptr(unsafe.Pointer(&r[0]))); errno != 0 {
+			return fmt.Errorf("cannot zero device range: %w", errno)
+		}
+		return nil
+	}
+	err = syscall.Fallocate(int(f.Fd()), FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, int64(offset), int64(length))
+	if err != nil {
+		err = syscall.Fallocate(int(f.Fd()), FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, int64(offset), int64(length))
+	}
+	if err != nil {
+		return fmt.Errorf("cannot zero file range: %w", err)
+	}
+	return nil
+}